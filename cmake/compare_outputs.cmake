@@ -0,0 +1,13 @@
+# Run two programs and fail unless they print the same:
+#   cmake -DFIRST=<program> -DSECOND=<program> -P compare_outputs.cmake
+
+execute_process(COMMAND ${FIRST} RESULT_VARIABLE first_result OUTPUT_VARIABLE first_output)
+execute_process(COMMAND ${SECOND} RESULT_VARIABLE second_result OUTPUT_VARIABLE second_output)
+
+if(NOT first_result EQUAL 0 OR NOT second_result EQUAL 0)
+    message(FATAL_ERROR "${FIRST} exited with ${first_result}, ${SECOND} with ${second_result}")
+endif()
+if(NOT first_output STREQUAL second_output)
+    message(FATAL_ERROR "outputs differ\n${FIRST}:\n${first_output}\n${SECOND}:\n${second_output}")
+endif()
+message("${first_output}")
@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <assert.h>
@@ -39,6 +40,7 @@
 
 #include "va_h264.h"
 #include "va_display.h"
+#include "h264quality.h"
 
 #define CHECK_VASTATUS(va_status,func)                                  \
     if (va_status != VA_STATUS_SUCCESS) {                               \
@@ -243,6 +245,31 @@ static void nal_header(bitstream *bs, int nal_ref_idc, int nal_unit_type)
     bitstream_put_ui(bs, nal_unit_type, 5);
 }
 
+#define HRD_DELAY_LENGTH 24
+
+static unsigned int hrd_bitrate(VA264Context * context)
+{
+    return (context->config.max_bitrate > context->config.frame_bitrate) ?
+        context->config.max_bitrate : context->config.frame_bitrate;
+}
+
+/* we write the SPS and PPS and can pack SEI NALs */
+static int packed_sei(VA264Context * context)
+{
+    int packed = context->h264_packedheader ? context->config_attrib[context->enc_packed_header_idx].value : 0;
+
+    return (packed & VA_ENC_PACKED_HEADER_SEQUENCE) && (packed & VA_ENC_PACKED_HEADER_MISC);
+}
+
+/*
+ * HRD parameters in the VUI oblige us to send buffering period and picture
+ * timing SEI, so only do it when we can.
+ */
+static int hrd_in_vui(VA264Context * context)
+{
+    return context->config.hrd_in_vui && context->config.hrd_buffer_size >= 16 && packed_sei(context);
+}
+
 static void sps_rbsp(VA264Context * context, bitstream *bs)
 {
     int profile_idc = PROFILE_IDC_BASELINE;
@@ -279,7 +306,8 @@ static void sps_rbsp(VA264Context * context, bitstream *bs)
     }
 
     bitstream_put_ue(bs, context->seq_param.max_num_ref_frames);        /* num_ref_frames */
-    bitstream_put_ui(bs, 0, 1);                                 /* gaps_in_frame_num_value_allowed_flag */
+    /* a decoder that lost frames before a long-term recovery, or was sent the base layer only, sees a gap */
+    bitstream_put_ui(bs, context->seq_param.max_num_ref_frames > num_ref_frames || context->temporal_layers > 2, 1); /* gaps_in_frame_num_value_allowed_flag */
 
     bitstream_put_ue(bs, context->seq_param.picture_width_in_mbs - 1);  /* pic_width_in_mbs_minus1 */
     bitstream_put_ue(bs, context->seq_param.picture_height_in_mbs - 1); /* pic_height_in_map_units_minus1 */
@@ -299,43 +327,42 @@ static void sps_rbsp(VA264Context * context, bitstream *bs)
         bitstream_put_ue(bs, context->seq_param.frame_crop_bottom_offset);      /* frame_crop_bottom_offset */
     }
 
-    //if ( frame_bit_rate < 0 ) { //TODO EW: the vui header isn't correct
-    if ( 1 ) {
-        bitstream_put_ui(bs, 0, 1); /* vui_parameters_present_flag */
-    } else {
-        bitstream_put_ui(bs, 1, 1); /* vui_parameters_present_flag */
-        bitstream_put_ui(bs, 0, 1); /* aspect_ratio_info_present_flag */
-        bitstream_put_ui(bs, 0, 1); /* overscan_info_present_flag */
-        bitstream_put_ui(bs, 0, 1); /* video_signal_type_present_flag */
-        bitstream_put_ui(bs, 0, 1); /* chroma_loc_info_present_flag */
-        bitstream_put_ui(bs, 1, 1); /* timing_info_present_flag */
-        {
-            bitstream_put_ui(bs, 15, 32);
-            bitstream_put_ui(bs, 900, 32);
-            bitstream_put_ui(bs, 1, 1);
-        }
+    bitstream_put_ui(bs, 1, 1); /* vui_parameters_present_flag */
+    bitstream_put_ui(bs, 0, 1); /* aspect_ratio_info_present_flag */
+    bitstream_put_ui(bs, 0, 1); /* overscan_info_present_flag */
+    bitstream_put_ui(bs, 0, 1); /* video_signal_type_present_flag */
+    bitstream_put_ui(bs, 0, 1); /* chroma_loc_info_present_flag */
+    bitstream_put_ui(bs, 1, 1); /* timing_info_present_flag */
+    {
+        bitstream_put_ui(bs, context->seq_param.num_units_in_tick, 32);
+        bitstream_put_ui(bs, context->seq_param.time_scale, 32);
+        bitstream_put_ui(bs, 0, 1); /* fixed_frame_rate_flag, the rate may change at runtime */
+    }
+    if (hrd_in_vui(context)) {
         bitstream_put_ui(bs, 1, 1); /* nal_hrd_parameters_present_flag */
         {
-            // hrd_parameters
+            // hrd_parameters, bit_rate_scale and cpb_size_scale 0: units of 64 and 16 bits
             bitstream_put_ue(bs, 0);    /* cpb_cnt_minus1 */
-            bitstream_put_ui(bs, 4, 4); /* bit_rate_scale */
-            bitstream_put_ui(bs, 6, 4); /* cpb_size_scale */
+            bitstream_put_ui(bs, 0, 4); /* bit_rate_scale */
+            bitstream_put_ui(bs, 0, 4); /* cpb_size_scale */
 
-            bitstream_put_ue(bs, context->config.frame_bitrate - 1); /* bit_rate_value_minus1[0] */
-            bitstream_put_ue(bs, context->config.frame_bitrate*8 - 1); /* cpb_size_value_minus1[0] */
-            bitstream_put_ui(bs, 1, 1);  /* cbr_flag[0] */
+            bitstream_put_ue(bs, hrd_bitrate(context) / 64 - 1); /* bit_rate_value_minus1[0] */
+            bitstream_put_ue(bs, context->config.hrd_buffer_size / 16 - 1); /* cpb_size_value_minus1[0] */
+            bitstream_put_ui(bs, context->config.rc_mode == VA_RC_CBR, 1);  /* cbr_flag[0] */
 
-            bitstream_put_ui(bs, 23, 5);   /* initial_cpb_removal_delay_length_minus1 */
-            bitstream_put_ui(bs, 23, 5);   /* cpb_removal_delay_length_minus1 */
-            bitstream_put_ui(bs, 23, 5);   /* dpb_output_delay_length_minus1 */
-            bitstream_put_ui(bs, 23, 5);   /* time_offset_length  */
+            bitstream_put_ui(bs, HRD_DELAY_LENGTH - 1, 5);   /* initial_cpb_removal_delay_length_minus1 */
+            bitstream_put_ui(bs, HRD_DELAY_LENGTH - 1, 5);   /* cpb_removal_delay_length_minus1 */
+            bitstream_put_ui(bs, HRD_DELAY_LENGTH - 1, 5);   /* dpb_output_delay_length_minus1 */
+            bitstream_put_ui(bs, 0, 5);   /* time_offset_length  */
         }
         bitstream_put_ui(bs, 0, 1);   /* vcl_hrd_parameters_present_flag */
         bitstream_put_ui(bs, 0, 1);   /* low_delay_hrd_flag */
-
-        bitstream_put_ui(bs, 0, 1); /* pic_struct_present_flag */
-        bitstream_put_ui(bs, 0, 1); /* bitstream_restriction_flag */
+    } else {
+        bitstream_put_ui(bs, 0, 1);   /* nal_hrd_parameters_present_flag */
+        bitstream_put_ui(bs, 0, 1);   /* vcl_hrd_parameters_present_flag */
     }
+    bitstream_put_ui(bs, 0, 1); /* pic_struct_present_flag */
+    bitstream_put_ui(bs, 0, 1); /* bitstream_restriction_flag */
 
     rbsp_trailing_bits(bs);     /* rbsp_trailing_bits */
 }
@@ -408,8 +435,22 @@ static void slice_header(VA264Context * context, bitstream *bs)
         if (context->slice_param.num_ref_idx_active_override_flag)
             bitstream_put_ue(bs, context->slice_param.num_ref_idx_l0_active_minus1);
 
-        /* ref_pic_list_reordering */
-        bitstream_put_ui(bs, 0, 1);            /* ref_pic_list_reordering_flag_l0: 0 */
+        /* ref_pic_list_reordering, a recovery picture moves its long-term reference to the front */
+        if (context->ltr_recovering >= 0) {
+            bitstream_put_ui(bs, 1, 1);        /* ref_pic_list_reordering_flag_l0: 1 */
+            bitstream_put_ue(bs, 2);           /* modification_of_pic_nums_idc: long_term_pic_num */
+            bitstream_put_ue(bs, context->ltr_recovering);
+            bitstream_put_ue(bs, 3);           /* end of the modifications */
+        } else if (context->temporal_ref > 0) {
+            /* a layered picture skips the newer references of its own or higher layers */
+            bitstream_put_ui(bs, 1, 1);        /* ref_pic_list_reordering_flag_l0: 1 */
+            bitstream_put_ue(bs, 0);           /* modification_of_pic_nums_idc: subtract from picNumPred */
+            bitstream_put_ue(bs, ((context->current_frame_num - context->ReferenceFrames[context->temporal_ref].frame_idx) &
+                                  ((1 << Log2MaxFrameNum) - 1)) - 1);     /* abs_diff_pic_num_minus1 */
+            bitstream_put_ue(bs, 3);           /* end of the modifications */
+        } else {
+            bitstream_put_ui(bs, 0, 1);        /* ref_pic_list_reordering_flag_l0: 0 */
+        }
     } else if (IS_B_SLICE(context->slice_param.slice_type)) {
         bitstream_put_ui(bs, context->slice_param.direct_spatial_mv_pred_flag, 1);            /* direct_spatial_mv_pred: 1 */
 
@@ -437,13 +478,23 @@ static void slice_header(VA264Context * context, bitstream *bs)
     if (context->pic_param.pic_fields.bits.reference_pic_flag) {     /* nal_ref_idc != 0 */
         unsigned char no_output_of_prior_pics_flag = 0;
         unsigned char long_term_reference_flag = 0;
-        unsigned char adaptive_ref_pic_marking_mode_flag = 0;
+        unsigned char adaptive_ref_pic_marking_mode_flag = (context->ltr_num_mmco > 0);
+        int i;
 
         if (context->pic_param.pic_fields.bits.idr_pic_flag) {
             bitstream_put_ui(bs, no_output_of_prior_pics_flag, 1);            /* no_output_of_prior_pics_flag: 0 */
             bitstream_put_ui(bs, long_term_reference_flag, 1);            /* long_term_reference_flag: 0 */
         } else {
-            bitstream_put_ui(bs, adaptive_ref_pic_marking_mode_flag, 1);            /* adaptive_ref_pic_marking_mode_flag: 0 */
+            bitstream_put_ui(bs, adaptive_ref_pic_marking_mode_flag, 1);            /* adaptive_ref_pic_marking_mode_flag */
+            for (i = 0; i < context->ltr_num_mmco; i++) {
+                bitstream_put_ue(bs, context->ltr_mmco[i][0]);               /* memory_management_control_operation */
+                if (context->ltr_mmco[i][0] != 5)
+                    bitstream_put_ue(bs, context->ltr_mmco[i][1]);
+                if (context->ltr_mmco[i][0] == 3)
+                    bitstream_put_ue(bs, context->ltr_mmco[i][2]);           /* long_term_frame_idx */
+            }
+            if (adaptive_ref_pic_marking_mode_flag)
+                bitstream_put_ue(bs, 0);
         }
     }
 
@@ -499,6 +550,123 @@ build_packed_seq_buffer(VA264Context * context, unsigned char **header_buffer)
     return bs.bit_offset;
 }
 
+/*
+ * Append one sei_message carrying 'payload', closing the payload with
+ * bit_equal_to_one and zero bits if it doesn't end on a byte boundary.
+ */
+static void sei_message(bitstream *bs, int payload_type, bitstream *payload)
+{
+    unsigned char *bytes;
+    int size, i;
+
+    if (payload->bit_offset & 7) {
+        bitstream_put_ui(payload, 1, 1);
+        bitstream_byte_aligning(payload, 0);
+    }
+    bitstream_end(payload);
+
+    size = payload->bit_offset / 8;
+    bytes = (unsigned char *)payload->buffer;
+    bitstream_put_ui(bs, payload_type, 8);
+    bitstream_put_ui(bs, size, 8);
+    for (i = 0; i < size; i++)
+        bitstream_put_ui(bs, bytes[i], 8);
+
+    free(payload->buffer);
+}
+
+/* whether the driver and the GOP setup allow rolling intra refresh in 'mode' */
+static int intra_refresh_supported(VA264Context * context, int mode)
+{
+    int caps = (mode == VA264_REFRESH_COLUMN) ? VA_ENC_INTRA_REFRESH_ROLLING_COLUMN : VA_ENC_INTRA_REFRESH_ROLLING_ROW;
+
+    return (context->intra_refresh_caps & caps) && context->config.ip_period == 1 && !context->temporal_layers;
+}
+
+/*
+ * Macroblock columns or rows to refresh, and how many of them to code
+ * intra per picture so a sweep takes intra_refresh_period pictures.
+ */
+static int intra_refresh_units(VA264Context * context, int * size)
+{
+    int units;
+
+    if (context->intra_refresh_mode == VA264_REFRESH_COLUMN)
+        units = context->frame_width_mbaligned / 16;
+    else
+        units = context->frame_height_mbaligned / 16;
+    *size = (units + context->intra_refresh_period - 1) / context->intra_refresh_period;
+    return units;
+}
+
+/* pic_timing SEI of the picture coded 'coded'-th and shown 'display'-th, in ticks, two per frame */
+static void pic_timing_sei(VA264Context * context, bitstream *bs, unsigned int coded, unsigned long long display)
+{
+    bitstream payload;
+    unsigned int cpb_removal_delay = 2 * (coded - context->hrd_bp_coded);
+    int dpb_output_delay = 2 * ((int)(display - context->current_IDR_display) -
+                                (int)(coded - context->hrd_idr_coded) + context->config.ip_period - 1);
+
+    bitstream_start(&payload);
+    bitstream_put_ui(&payload, cpb_removal_delay, HRD_DELAY_LENGTH);
+    bitstream_put_ui(&payload, dpb_output_delay, HRD_DELAY_LENGTH);
+    sei_message(bs, 1, &payload);
+}
+
+/*
+ * With the HRD in the VUI, picture timing SEI for every picture, preceded by
+ * a buffering period SEI on IDR pictures.  A recovery point SEI on pictures
+ * that start an intra refresh sweep or are requested I frames, where a
+ * decoder can join the stream.
+ */
+static int build_packed_sei_buffer(VA264Context * context, unsigned char **header_buffer)
+{
+    bitstream bs, payload;
+    unsigned int coded = context->frames_coded - 1;
+    int units, size, recovery_frame_cnt;
+
+    bitstream_start(&bs);
+    nal_start_code_prefix(&bs);
+    nal_header(&bs, NAL_REF_IDC_NONE, NAL_SEI);
+
+    if (hrd_in_vui(context)) {
+        if (context->pic_param.pic_fields.bits.idr_pic_flag) {
+            unsigned long long initial_delay = (unsigned long long)context->config.hrd_initial_fullness * 90000 / hrd_bitrate(context);
+
+            bitstream_start(&payload);
+            bitstream_put_ue(&payload, context->seq_param.seq_parameter_set_id);
+            bitstream_put_ui(&payload, initial_delay ? initial_delay : 1, HRD_DELAY_LENGTH); /* initial_cpb_removal_delay */
+            bitstream_put_ui(&payload, 0, HRD_DELAY_LENGTH);                                 /* initial_cpb_removal_delay_offset */
+            sei_message(&bs, 0, &payload);   /* buffering_period */
+
+            context->hrd_bp_coded = coded;
+        }
+
+        pic_timing_sei(context, &bs, coded, context->current_frame_display);
+    }
+
+    if (context->intra_refresh_start || context->keyframe_recovery) {
+        /* every P frame is a reference, so frame_num counts the pictures of the sweep */
+        recovery_frame_cnt = 0;
+        if (context->intra_refresh_start) {
+            units = intra_refresh_units(context, &size);
+            recovery_frame_cnt = (units + size - 1) / size - 1;
+        }
+        bitstream_start(&payload);
+        bitstream_put_ue(&payload, recovery_frame_cnt);             /* recovery_frame_cnt */
+        bitstream_put_ui(&payload, context->keyframe_recovery, 1); /* exact_match_flag */
+        bitstream_put_ui(&payload, 0, 1);                           /* broken_link_flag */
+        bitstream_put_ui(&payload, 0, 2);                           /* changing_slice_group_idc */
+        sei_message(&bs, 6, &payload);       /* recovery_point */
+    }
+
+    rbsp_trailing_bits(&bs);
+    bitstream_end(&bs);
+
+    *header_buffer = (unsigned char *)bs.buffer;
+    return bs.bit_offset;
+}
+
 static int build_packed_slice_buffer(VA264Context * context, unsigned char **header_buffer)
 {
     bitstream bs;
@@ -511,7 +679,7 @@ static int build_packed_slice_buffer(VA264Context * context, unsigned char **hea
     if (IS_I_SLICE(context->slice_param.slice_type)) {
         nal_header(&bs, NAL_REF_IDC_HIGH, is_idr ? NAL_IDR : NAL_NON_IDR);
     } else if (IS_P_SLICE(context->slice_param.slice_type)) {
-        nal_header(&bs, NAL_REF_IDC_MEDIUM, NAL_NON_IDR);
+        nal_header(&bs, is_ref ? NAL_REF_IDC_MEDIUM : NAL_REF_IDC_NONE, NAL_NON_IDR);
     } else {
         assert(IS_B_SLICE(context->slice_param.slice_type));
         nal_header(&bs, is_ref ? NAL_REF_IDC_LOW : NAL_REF_IDC_NONE, NAL_NON_IDR);
@@ -524,6 +692,98 @@ static int build_packed_slice_buffer(VA264Context * context, unsigned char **hea
     return bs.bit_offset;
 }
 
+/*
+ * Copy a NAL unit built with the bitstream helpers, inserting emulation
+ * prevention bytes after the start code and NAL header.  Headers handed to
+ * the driver don't need this (has_emulation_bytes = 0), but NAL units we
+ * emit ourselves do.
+ */
+static int escape_nal_unit(const unsigned char *src, int size, unsigned char *dst)
+{
+    int i, out = 5, zeros = 0;
+
+    memcpy(dst, src, 5); /* start code prefix and nal_unit_header */
+
+    for (i = 5; i < size; i++) {
+        if (zeros == 2 && src[i] <= 3) {
+            dst[out++] = 3;
+            zeros = 0;
+        }
+        dst[out++] = src[i];
+        zeros = src[i] ? 0 : zeros + 1;
+    }
+    return out;
+}
+
+#define SKIP_PPS_ID 1
+
+/*
+ * A second PPS that only differs from the regular one by selecting CAVLC,
+ * so skipped pictures can be written as a single mb_skip_run regardless of
+ * the entropy coder used for real pictures.
+ */
+static int build_skip_pps_buffer(VA264Context * context, unsigned char **header_buffer)
+{
+    VAEncPictureParameterBufferH264 pic_param = context->pic_param;
+    int length_in_bits;
+
+    context->pic_param.pic_parameter_set_id = SKIP_PPS_ID;
+    context->pic_param.pic_fields.bits.entropy_coding_mode_flag = ENTROPY_MODE_CAVLC;
+    length_in_bits = build_packed_pic_buffer(context, header_buffer);
+    context->pic_param = pic_param;
+
+    return length_in_bits;
+}
+
+/* pic_timing SEI for a skipped picture, coded next and shown 'display'-th */
+static int build_skip_sei_buffer(VA264Context * context, unsigned long long display, unsigned char **header_buffer)
+{
+    bitstream bs;
+
+    bitstream_start(&bs);
+    nal_start_code_prefix(&bs);
+    nal_header(&bs, NAL_REF_IDC_NONE, NAL_SEI);
+    pic_timing_sei(context, &bs, context->frames_coded, display);
+    rbsp_trailing_bits(&bs);
+    bitstream_end(&bs);
+
+    *header_buffer = (unsigned char *)bs.buffer;
+    return bs.bit_offset;
+}
+
+/*
+ * Non-reference P picture where every macroblock is P_Skip, decoding to a
+ * copy of the previous reference picture.
+ */
+static int build_skip_slice_buffer(VA264Context * context, unsigned int pic_order_cnt_lsb, unsigned char **header_buffer)
+{
+    bitstream bs;
+
+    bitstream_start(&bs);
+    nal_start_code_prefix(&bs);
+    nal_header(&bs, NAL_REF_IDC_NONE, NAL_NON_IDR);
+
+    bitstream_put_ue(&bs, 0);                               /* first_mb_in_slice */
+    bitstream_put_ue(&bs, SLICE_TYPE_P);                    /* slice_type */
+    bitstream_put_ue(&bs, SKIP_PPS_ID);                     /* pic_parameter_set_id */
+    bitstream_put_ui(&bs, context->current_frame_num % (1 << Log2MaxFrameNum), Log2MaxFrameNum); /* frame_num */
+    bitstream_put_ui(&bs, pic_order_cnt_lsb, Log2MaxPicOrderCntLsb);            /* pic_order_cnt_lsb */
+    bitstream_put_ui(&bs, 1, 1);                            /* num_ref_idx_active_override_flag */
+    bitstream_put_ue(&bs, 0);                               /* num_ref_idx_l0_active_minus1 */
+    bitstream_put_ui(&bs, 0, 1);                            /* ref_pic_list_reordering_flag_l0 */
+    /* nal_ref_idc == 0: no dec_ref_pic_marking, CAVLC: no cabac_init_idc */
+    bitstream_put_se(&bs, 0);                               /* slice_qp_delta */
+    bitstream_put_ue(&bs, 1);                               /* disable_deblocking_filter_idc */
+
+    /* slice_data */
+    bitstream_put_ue(&bs, context->frame_width_mbaligned * context->frame_height_mbaligned / (16 * 16));  /* mb_skip_run */
+    rbsp_trailing_bits(&bs);
+    bitstream_end(&bs);
+
+    *header_buffer = (unsigned char *)bs.buffer;
+    return bs.bit_offset;
+}
+
 
 /*
  * Helper function for profiling purposes
@@ -537,13 +797,13 @@ static unsigned int GetTickCount()
 }
 
 /*
-  Assume frame sequence is: Frame#0,#1,#2,...,#M,...,#X,... (encoding order)
-  1) period between Frame #X and Frame #N = #X - #N
-  2) 0 means infinite for intra_period/intra_idr_period, and 0 is invalid for ip_period
-  3) intra_idr_period % intra_period (intra_period > 0) and intra_period % ip_period must be 0
-  4) intra_period and intra_idr_period take precedence over ip_period
-  5) if ip_period > 1, intra_period and intra_idr_period are not  the strict periods
-     of I/IDR frames, see bellow examples
+  Frame types come from the GOP planner, see plan_mini_gop:
+  1) 0 means infinite for intra_period/intra_idr_period, and 0 is invalid for ip_period
+  2) intra_idr_period % intra_period (intra_period > 0) and intra_period % ip_period must be 0
+  3) periods count frames in display order, an IDR also counts as an I frame
+  4) intra_period and intra_idr_period take precedence over ip_period: the
+     B frames before a periodic I frame are kept, an IDR is never preceded
+     by B frames, so the mini-GOP before it ends early
   -------------------------------------------------------------------
   intra_period intra_idr_period ip_period frame sequence (intra_period/intra_idr_period/ip_period)
   0            ignored          1          IDRPPPPPPP ...     (No IDR/I any more)
@@ -552,72 +812,22 @@ static unsigned int GetTickCount()
   1            1                ignored    IDR IDR IDR IDR...
   1            >=2              ignored    IDRII IDRII IDR... (1/3/ignore)
   >=2          0                1          IDRPPP IPPP I...   (3/0/1)
-  >=2          0              >=2          IDR(PBB)(PBB)(IBB) (6/0/3)
-                                              (PBB)(IBB)(PBB)(IBB)...
+  >=2          0              >=2          IDR(PBB)(IBB)(PBB)(IBB)... (6/0/3)
   >=2          >=2              1          IDRPPPPP IPPPPP IPPPPP (6/18/1)
                                            IDRPPPPP IPPPPP IPPPPP...
-  >=2          >=2              >=2        {IDR(PBB)(PBB)(IBB)(PBB)(IBB)(PBB)} (6/18/3)
-                                           {IDR(PBB)(PBB)(IBB)(PBB)(IBB)(PBB)}...
-                                           {IDR(PBB)(PBB)(IBB)(PBB)}           (6/12/3)
-                                           {IDR(PBB)(PBB)(IBB)(PBB)}...
-                                           {IDR(PBB)(PBB)}                     (6/6/3)
-                                           {IDR(PBB)(PBB)}.
+  >=2          >=2              >=2        {IDR(PBB)(IBB)(PBB)(IBB)(PBB)(PB)} (6/18/3)
+                                           {IDR(PBB)(IBB)(PBB)(IBB)(PBB)(PB)}...
+                                           {IDR(PBB)(PB)}                     (6/6/3)
+                                           {IDR(PBB)(PB)}...
+
+  With setAdaptiveGOP the planner also follows the content: a scene cut
+  starts a new GOP, fast motion shortens the runs of B frames and static
+  content postpones periodic I frames, within a maximum GOP length.
 */
-
-/*
- * Return displaying order with specified periods and encoding order
- * displaying_order: displaying order
- * frame_type: frame type
- */
 #define FRAME_P 0
 #define FRAME_B 1
 #define FRAME_I 2
 #define FRAME_IDR 7
-void encoding2display_order(
-    unsigned long long encoding_order,int intra_period,
-    int intra_idr_period,int ip_period,
-    unsigned long long *displaying_order,
-    int *frame_type)
-{
-    int encoding_order_gop = 0;
-
-    if (intra_period == 1) { /* all are I/IDR frames */
-        *displaying_order = encoding_order;
-        if (intra_idr_period == 0)
-            *frame_type = (encoding_order == 0)?FRAME_IDR:FRAME_I;
-        else
-            *frame_type = (encoding_order % intra_idr_period == 0)?FRAME_IDR:FRAME_I;
-        return;
-    }
-
-    if (intra_period == 0)
-        intra_idr_period = 0;
-
-    /* new sequence like
-     * IDR PPPPP IPPPPP
-     * IDR (PBB)(PBB)(IBB)(PBB)
-     */
-    encoding_order_gop = (intra_idr_period == 0) ? encoding_order :
-        (encoding_order % (intra_idr_period + ((ip_period == 1) ? 0 : 1)));
-
-    if (encoding_order_gop == 0) { /* the first frame */
-        *frame_type = FRAME_IDR;
-        *displaying_order = encoding_order;
-    } else if (((encoding_order_gop - 1) % ip_period) != 0) { /* B frames */
-        *frame_type = FRAME_B;
-        *displaying_order = encoding_order - 1;
-    } else if ((intra_period != 0) && /* have I frames */
-               (encoding_order_gop >= 2) &&
-               ((ip_period == 1 && encoding_order_gop % intra_period == 0) || /* for IDR PPPPP IPPPP */
-                /* for IDR (PBB)(PBB)(IBB) */
-                (ip_period >= 2 && ((encoding_order_gop - 1) / ip_period % (intra_period / ip_period)) == 0))) {
-    *frame_type = FRAME_I;
-    *displaying_order = encoding_order + ip_period - 1;
-    } else {
-    *frame_type = FRAME_P;
-    *displaying_order = encoding_order + ip_period - 1;
-    }
-}
 
 
 static char *fourcc_to_string(int fourcc)
@@ -676,23 +886,40 @@ static char *rc_to_string(int rcmode)
     }
 }
 
-static int init_va(VA264Context * context)
+/*
+ * (Re)start the software rate control from the current configuration.
+ */
+static void setup_soft_rc(VA264Context * context)
+{
+    rateControlInit(&context->soft_rc, context->soft_rc_mode,
+                    context->config.frame_bitrate, context->config.max_bitrate,
+                    (double)context->config.frame_rate_num / context->config.frame_rate_den,
+                    context->config.hrd_buffer_size, context->config.hrd_initial_fullness,
+                    context->config.initial_qp, context->config.minimal_qp, 51);
+}
+
+/*
+ * Pick the profile, entrypoint and rate control mode and collect the
+ * config attributes for them.  Can be run again on an open display when
+ * the profile or rate control mode changes.
+ */
+static int probe_config(VA264Context * context)
 {
     VAProfile profile_list[]={VAProfileH264High,VAProfileH264Main,VAProfileH264ConstrainedBaseline};
     VAEntrypoint *entrypoints;
     int num_entrypoints, slice_entrypoint;
     int support_encode = 0;
-    int major_ver, minor_ver;
     VAStatus va_status;
     unsigned int i;
 
-    context->va_dpy = va_open_display();
-    if(!context->va_dpy) {
-        return VA_STATUS_ERROR_INVALID_DISPLAY;
-    }
-
-    va_status = vaInitialize(context->va_dpy, &major_ver, &minor_ver);
-    CHECK_VASTATUS(va_status, "vaInitialize");
+    context->config_attrib_num = 0;
+    context->constraint_set_flag = 0;
+    context->h264_packedheader = 0;
+    context->max_frame_size_caps = 0;
+    context->roi_caps = 0;
+    context->intra_refresh_caps = 0;
+    context->qp_block_size = 0;
+    context->soft_rc_mode = 0;
 
     num_entrypoints = vaMaxNumEntrypoints(context->va_dpy);
     entrypoints = malloc(num_entrypoints * sizeof(*entrypoints));
@@ -777,8 +1004,8 @@ static int init_va(VA264Context * context)
     }
 
     if (context->attrib[VAConfigAttribRateControl].value != VA_ATTRIB_NOT_SUPPORTED) {
-        context->attrib[VAConfigAttribRateControl].value = VA_RC_CBR;
         int tmp = context->attrib[VAConfigAttribRateControl].value;
+        int requested = context->config.rc_mode;
 
         printf("Support rate control mode (0x%x):", tmp);
 
@@ -810,6 +1037,12 @@ static int init_va(VA264Context * context)
             }
 
             printf("RateControl mode: %s\n", rc_to_string(context->config.rc_mode));
+
+            /* a CQP-only driver still gets a bitrate, from our own rate control */
+            if (context->config.rc_mode == VA_RC_CQP && (requested == VA_RC_CBR || requested == VA_RC_VBR)) {
+                printf("Rate controlling CQP in software for %s\n", rc_to_string(requested));
+                context->soft_rc_mode = requested;
+            }
         }
 
         context->config_attrib[context->config_attrib_num].type = VAConfigAttribRateControl;
@@ -894,22 +1127,78 @@ static int init_va(VA264Context * context)
     }
     if (context->attrib[VAConfigAttribEncMacroblockInfo].value != VA_ATTRIB_NOT_SUPPORTED) {
         printf("Support VAConfigAttribEncMacroblockInfo\n");
+
+        /* the QP map granularity, a macroblock unless the driver says otherwise */
+        context->qp_block_size = 16;
+        if (context->attrib[VAConfigAttribQPBlockSize].value != VA_ATTRIB_NOT_SUPPORTED &&
+            context->attrib[VAConfigAttribQPBlockSize].value >= 16)
+            context->qp_block_size = context->attrib[VAConfigAttribQPBlockSize].value;
+        printf("Support a QP map with %dx%d blocks\n", context->qp_block_size, context->qp_block_size);
+    }
+    if (context->attrib[VAConfigAttribEncROI].value != VA_ATTRIB_NOT_SUPPORTED) {
+        VAConfigAttribValEncROI caps;
+
+        caps.value = context->attrib[VAConfigAttribEncROI].value;
+        printf("Support %d ROI regions%s%s\n", caps.bits.num_roi_regions,
+               caps.bits.roi_rc_qp_delta_support ? ", QP delta under rate control" : "",
+               caps.bits.roi_rc_priority_support ? ", priority under rate control" : "");
+        if (caps.bits.num_roi_regions)
+            context->roi_caps = caps.value;
+    }
+    if (context->attrib[VAConfigAttribEncIntraRefresh].value != VA_ATTRIB_NOT_SUPPORTED) {
+        int tmp = context->attrib[VAConfigAttribEncIntraRefresh].value;
+
+        if (tmp & VA_ENC_INTRA_REFRESH_ROLLING_COLUMN)
+            printf("Support VA_ENC_INTRA_REFRESH_ROLLING_COLUMN\n");
+        if (tmp & VA_ENC_INTRA_REFRESH_ROLLING_ROW)
+            printf("Support VA_ENC_INTRA_REFRESH_ROLLING_ROW\n");
+        context->intra_refresh_caps = tmp & (VA_ENC_INTRA_REFRESH_ROLLING_COLUMN | VA_ENC_INTRA_REFRESH_ROLLING_ROW);
+    }
+    if (context->attrib[VAConfigAttribEncMaxFrameSize].value != VA_ATTRIB_NOT_SUPPORTED) {
+        VAConfigAttribValMaxFrameSize caps;
+
+        caps.value = context->attrib[VAConfigAttribEncMaxFrameSize].value;
+        if (caps.bits.max_frame_size) {
+            printf("Support VAConfigAttribEncMaxFrameSize%s\n", caps.bits.multiple_pass ? " with multiple passes" : "");
+            context->max_frame_size_caps = caps.value;
+        }
     }
 
+    if (context->soft_rc_mode)
+        setup_soft_rc(context);
+
     free(entrypoints);
     return 0;
 }
 
-static int setup_encode(VA264Context * context)
+static int init_va(VA264Context * context)
+{
+    /* every context in the process shares one display and driver instance */
+    context->va_dpy = va_acquire_display(context->placement, context->device);
+    if(!context->va_dpy) {
+        return VA_STATUS_ERROR_INVALID_DISPLAY;
+    }
+    /* remember where we landed, so related contexts can be pinned next to us */
+    va_display_device_path(context->va_dpy, context->device, sizeof(context->device));
+
+    return probe_config(context);
+}
+
+static int setup_config(VA264Context * context)
 {
     VAStatus va_status;
-    VASurfaceID *tmp_surfaceid;
-    int codedbuf_size, i;
 
     va_status = vaCreateConfig(context->va_dpy, context->config.h264_profile, context->selected_entrypoint,
             &context->config_attrib[0], context->config_attrib_num, &context->config_id);
     CHECK_VASTATUS(va_status, "vaCreateConfig");
 
+    return 0;
+}
+
+static int setup_surfaces(VA264Context * context)
+{
+    VAStatus va_status;
+
     /* create source surfaces */
     va_status = vaCreateSurfaces(context->va_dpy,
                                  VA_RT_FORMAT_YUV420, context->frame_width_mbaligned, context->frame_height_mbaligned,
@@ -926,17 +1215,38 @@ static int setup_encode(VA264Context * context)
         );
     CHECK_VASTATUS(va_status, "vaCreateSurfaces");
 
-    tmp_surfaceid = calloc(2 * SURFACE_NUM, sizeof(VASurfaceID));
+    /* long-term references outlive the reference surfaces of their display slot */
+    if (context->ltr_count) {
+        va_status = vaCreateSurfaces(context->va_dpy,
+                                     VA_RT_FORMAT_YUV420, context->frame_width_mbaligned, context->frame_height_mbaligned,
+                                     &context->ltr_surface[0], VA264_LTR_SURFACES,
+                                     NULL, 0);
+        CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+        context->ltr_surfaces = 1;
+    }
+
+    return 0;
+}
+
+static int setup_context(VA264Context * context)
+{
+    VAStatus va_status;
+    VASurfaceID *tmp_surfaceid;
+    int codedbuf_size, i;
+
+    tmp_surfaceid = calloc(2 * SURFACE_NUM + VA264_LTR_SURFACES, sizeof(VASurfaceID));
     assert(tmp_surfaceid);
     memcpy(tmp_surfaceid, context->src_surface, SURFACE_NUM * sizeof(VASurfaceID));
     memcpy(tmp_surfaceid + SURFACE_NUM, context->ref_surface, SURFACE_NUM * sizeof(VASurfaceID));
+    if (context->ltr_surfaces)
+        memcpy(tmp_surfaceid + 2 * SURFACE_NUM, context->ltr_surface, VA264_LTR_SURFACES * sizeof(VASurfaceID));
 
     /* Create a context for this encode pipe */
     va_status = vaCreateContext(context->va_dpy, 
                                 context->config_id,
                                 context->frame_width_mbaligned, context->frame_height_mbaligned,
                                 VA_PROGRESSIVE,
-                                tmp_surfaceid, 2 * SURFACE_NUM,
+                                tmp_surfaceid, 2 * SURFACE_NUM + (context->ltr_surfaces ? VA264_LTR_SURFACES : 0),
                                 &context->context_id);
     CHECK_VASTATUS(va_status, "vaCreateContext");
     free(tmp_surfaceid);
@@ -953,11 +1263,31 @@ static int setup_encode(VA264Context * context)
         va_status = vaCreateBuffer(context->va_dpy, context->context_id, VAEncCodedBufferType,
                 codedbuf_size, 1, NULL, &context->coded_buf[i]);
         CHECK_VASTATUS(va_status,"vaCreateBuffer");
+
+        /* QP maps are pooled too, created on first use, see setNextFrameQPMap */
+        context->qp_buf[i] = VA_INVALID_ID;
+        context->qp_delta[i] = NULL;
+        context->input_qp_map[i] = 0;
     }
 
     return 0;
 }
 
+static int setup_encode(VA264Context * context)
+{
+    VAStatus va_status;
+
+    va_status = setup_config(context);
+    if (va_status != VA_STATUS_SUCCESS)
+        return va_status;
+
+    va_status = setup_surfaces(context);
+    if (va_status != VA_STATUS_SUCCESS)
+        return va_status;
+
+    return setup_context(context);
+}
+
 
 
 #define partition(ref, field, key, ascending)   \
@@ -1022,17 +1352,103 @@ static void sort_two(VAPictureH264 ref[], int left, int right, unsigned int key,
     sort_one(ref, j+1, right, list1_ascending, frame_idx);
 }
 
+/* position of the short-term reference 'diff + 1' pictures before the current one, -1 if there is none */
+static int find_short_term(VA264Context * context, int diff)
+{
+    unsigned int mask = (1 << Log2MaxFrameNum) - 1;
+    unsigned int pic_num = (context->current_frame_num - diff - 1) & mask;
+    unsigned int i;
+
+    for (i = 0; i < context->numShortTerm; i++)
+        if ((context->ReferenceFrames[i].frame_idx & mask) == pic_num)
+            return i;
+    return -1;
+}
+
+static void remove_short_term(VA264Context * context, int i)
+{
+    for (; i < (int)context->numShortTerm - 1; i++)
+        context->ReferenceFrames[i] = context->ReferenceFrames[i+1];
+    context->numShortTerm--;
+}
+
+static int num_long_term(VA264Context * context)
+{
+    int i, n = 0;
+
+    for (i = 0; i < context->ltr_count; i++)
+        if (!(context->ltr_pic[i].flags & VA_PICTURE_H264_INVALID))
+            n++;
+    return n;
+}
+
+/*
+ * Apply the memory management operations of the picture just coded to our
+ * model of the DPB, as the decoder will.
+ */
+static void apply_mmco(VA264Context * context)
+{
+    int i, j, slot;
+
+    for (i = 0; i < context->ltr_num_mmco; i++) {
+        switch (context->ltr_mmco[i][0]) {
+        case 1:     /* short-term unused for reference */
+            j = find_short_term(context, context->ltr_mmco[i][1]);
+            if (j >= 0)
+                remove_short_term(context, j);
+            break;
+        case 3:     /* short-term to long-term */
+            j = find_short_term(context, context->ltr_mmco[i][1]);
+            if (j < 0)
+                break;
+            slot = context->ltr_mmco[i][2];
+            context->ltr_pic[slot] = context->ReferenceFrames[j];
+            context->ltr_pic[slot].flags = VA_PICTURE_H264_LONG_TERM_REFERENCE;
+            context->ltr_pic[slot].frame_idx = slot;
+            context->ltr_pic_surface[slot] = context->ltr_mark_surface;
+            context->ltr_display[slot] = context->ltr_mark_display;
+            context->ltr_marked[slot] = context->current_frame_display;
+            remove_short_term(context, j);
+            break;
+        case 4:     /* MaxLongTermFrameIdx, dropping the slots above it */
+        case 5:     /* everything unused, this picture counts as frame_num 0 and POC 0 */
+            for (slot = context->ltr_mmco[i][0] == 4 ? context->ltr_mmco[i][1] : 0; slot < VA264_MAX_LTR; slot++) {
+                context->ltr_pic[slot].picture_id = VA_INVALID_SURFACE;
+                context->ltr_pic[slot].flags = VA_PICTURE_H264_INVALID;
+            }
+            if (context->ltr_mmco[i][0] == 5) {
+                context->numShortTerm = 0;
+                context->current_frame_num = 0;
+                context->CurrentCurrPic.frame_idx = 0;
+                context->CurrentCurrPic.TopFieldOrderCnt = context->CurrentCurrPic.BottomFieldOrderCnt = 0;
+                context->PicOrderCntMsb_ref = context->pic_order_cnt_lsb_ref = 0;
+                context->poc_display = context->current_frame_display;
+            }
+            break;
+        }
+    }
+}
+
 static int update_ReferenceFrames(VA264Context * context)
 {
-    int i;
+    int i, max_short_term = num_ref_frames;
 
-    if (context->current_frame_type == FRAME_B)
+    /* B frames and the top temporal layer */
+    if (!context->pic_param.pic_fields.bits.reference_pic_flag)
         return 0;
 
+    /* the sliding window only applies without memory management operations */
+    if (context->ltr_num_mmco) {
+        apply_mmco(context);
+        max_short_term = SURFACE_NUM;
+    } else if (context->ltr_count) {
+        max_short_term = (int)num_ref_frames + context->ltr_count - num_long_term(context);
+    }
+
     context->CurrentCurrPic.flags = VA_PICTURE_H264_SHORT_TERM_REFERENCE;
     context->numShortTerm++;
-    if (context->numShortTerm > num_ref_frames)
-        context->numShortTerm = num_ref_frames;
+    if (context->numShortTerm > (unsigned int)max_short_term)
+        context->numShortTerm = max_short_term;
     for (i = context->numShortTerm - 1; i > 0; i--)
         context->ReferenceFrames[i] = context->ReferenceFrames[i-1];
     context->ReferenceFrames[0] = context->CurrentCurrPic;
@@ -1045,6 +1461,154 @@ static int update_ReferenceFrames(VA264Context * context)
     return 0;
 }
 
+/*
+ * Long-term reference bookkeeping for the picture about to be coded: the
+ * memory management operations its slice header carries, whether it
+ * recovers from a loss, and whether it is kept as the next long-term
+ * reference.  It is reconstructed into a surface of its own then, and
+ * marked long-term by the next reference picture so it stays the first
+ * short-term reference until then.
+ */
+static void plan_references(VA264Context * context)
+{
+    int i, slot, diff, prev = context->ltr_candidate, in_use = 0, candidate = 0;
+    unsigned long long display = context->current_frame_display;
+
+    context->ltr_num_mmco = 0;
+    context->ltr_recovering = -1;
+    context->ltr_candidate = -1;
+    if (!context->ltr_count || context->current_frame_type == FRAME_B)
+        return;
+
+    for (i = 0; i < context->ltr_count; i++)
+        if (!(context->ltr_pic[i].flags & VA_PICTURE_H264_INVALID))
+            in_use |= 1 << context->ltr_pic_surface[i];
+    if (prev >= 0)
+        in_use |= 1 << prev;
+
+    if (context->current_frame_type == FRAME_IDR) {
+        for (i = 0; i < VA264_MAX_LTR; i++) {
+            context->ltr_pic[i].picture_id = VA_INVALID_SURFACE;
+            context->ltr_pic[i].flags = VA_PICTURE_H264_INVALID;
+        }
+        in_use = 0;
+        context->ltr_max_idx_set = 0;
+        context->ltr_recover_slot = -1;
+        context->ltr_clean_display = display;
+        context->ltr_clean_ref = -1;
+        candidate = 1;
+    } else if (context->ltr_recover_slot >= 0) {
+        /*
+         * Refer to the long-term reference only, then empty the DPB and
+         * restart frame_num and POC as an IDR would.  The decoder's DPB may
+         * differ from ours since the loss, this makes them the same again.
+         */
+        if (context->current_frame_type == FRAME_P)
+            context->ltr_recovering = context->ltr_recover_slot;
+        context->ltr_mmco[context->ltr_num_mmco++][0] = 5;
+        context->ltr_max_idx_set = 0;
+        context->ltr_clean_ref = context->ltr_marked[context->ltr_recover_slot];
+        context->ltr_recover_slot = -1;
+        context->ltr_clean_display = display;
+        candidate = 1;
+    } else if (prev >= 0) {
+        /* an empty slot, or the oldest long-term reference */
+        slot = 0;
+        for (i = 0; i < context->ltr_count; i++) {
+            if (context->ltr_pic[i].flags & VA_PICTURE_H264_INVALID) {
+                slot = i;
+                break;
+            }
+            if (context->ltr_display[i] < context->ltr_display[slot])
+                slot = i;
+        }
+
+        if (!context->ltr_max_idx_set) {
+            context->ltr_mmco[context->ltr_num_mmco][0] = 4;
+            context->ltr_mmco[context->ltr_num_mmco++][1] = context->ltr_count;
+            context->ltr_max_idx_set = 1;
+        }
+        /* a new slot takes the place of the short-term reference the sliding window would drop */
+        if ((context->ltr_pic[slot].flags & VA_PICTURE_H264_INVALID) && context->numShortTerm > 1 &&
+            (int)context->numShortTerm + num_long_term(context) >= (int)num_ref_frames + context->ltr_count) {
+            diff = (context->current_frame_num - context->ReferenceFrames[context->numShortTerm - 1].frame_idx - 1) & ((1 << Log2MaxFrameNum) - 1);
+            context->ltr_mmco[context->ltr_num_mmco][0] = 1;
+            context->ltr_mmco[context->ltr_num_mmco++][1] = diff;
+        }
+        context->ltr_mmco[context->ltr_num_mmco][0] = 3;
+        context->ltr_mmco[context->ltr_num_mmco][1] = 0;    /* the previous reference picture */
+        context->ltr_mmco[context->ltr_num_mmco++][2] = slot;
+        context->ltr_mark_surface = prev;
+        context->ltr_mark_display = context->ltr_candidate_display;
+    }
+
+    if (context->ltr_interval && display - context->ltr_candidate_display >= (unsigned long long)context->ltr_interval)
+        candidate = 1;
+    if (!candidate && prev < 0 && num_long_term(context) == 0)
+        candidate = 1;
+
+    if (candidate) {
+        for (i = 0; i < VA264_LTR_SURFACES; i++)
+            if (!(in_use & (1 << i)))
+                break;
+        context->ltr_candidate = i;
+        context->ltr_candidate_display = display;
+        context->frame_info.long_term = true;
+    }
+}
+
+/*
+ * Memory management operations that leave the picture about to be coded as
+ * the only short-term reference, so nothing after it refers to a picture
+ * before it.
+ */
+static void drop_short_term(VA264Context * context)
+{
+    unsigned int i;
+
+    for (i = 0; i < context->numShortTerm && context->ltr_num_mmco < VA264_MAX_MMCO; i++) {
+        context->ltr_mmco[context->ltr_num_mmco][0] = 1;
+        context->ltr_mmco[context->ltr_num_mmco++][1] =
+            (context->current_frame_num - context->ReferenceFrames[i].frame_idx - 1) & ((1 << Log2MaxFrameNum) - 1);
+    }
+}
+
+/*
+ * Temporal layer of the picture about to be coded and what it refers to.
+ * The layers repeat 0 1 (L1T2) or 0 2 1 2 (L1T3) from every intra picture.
+ * Pictures below the top layer refer to the last base layer picture, those
+ * in the top layer to the newest reference, which is of a lower layer as
+ * the top layer is never a reference.  So each layer decodes with the ones
+ * below it alone.
+ */
+static void plan_temporal_layer(VA264Context * context)
+{
+    int pos, top, i;
+
+    context->temporal_ref = -1;
+    context->frame_info.temporal_id = 0;
+    if (!context->temporal_layers)
+        return;
+
+    if (context->current_frame_type != FRAME_P)
+        context->temporal_pos = 0;
+    pos = context->temporal_pos++;
+    if (context->temporal_layers == 2)
+        context->frame_info.temporal_id = pos & 1;
+    else
+        context->frame_info.temporal_id = (pos & 1) ? 2 : (pos & 2) >> 1;
+    top = context->temporal_layers - 1;
+
+    if (context->current_frame_type == FRAME_P) {
+        context->temporal_ref = 0;
+        if (context->frame_info.temporal_id < top)
+            for (i = 0; i < (int)context->numShortTerm; i++)
+                if (context->ReferenceFrames[i].frame_idx == context->temporal_base_num)
+                    context->temporal_ref = i;
+    }
+    if (context->frame_info.temporal_id == 0)
+        context->temporal_base_num = context->current_frame_num;
+}
 
 static int update_RefPicList(VA264Context * context)
 {
@@ -1097,14 +1661,302 @@ static int update_RefPicList(VA264Context * context)
 }
 
 
-static int render_sequence(VA264Context * context)
+/*
+ * Rate control misc parameter.  Sent with every sequence, and on its own
+ * with 'reset' set when setBitrate changes the target mid-stream so the
+ * driver's rate controller adapts without waiting for the next IDR.
+ */
+static int render_rate_control(VA264Context * context, int reset)
 {
-    VABufferID seq_param_buf, rc_param_buf, misc_param_tmpbuf, render_id[2];
+    VABufferID rc_param_buf;
     VAStatus va_status;
-    VAEncMiscParameterBuffer *misc_param, *misc_param_tmp;
+    VAEncMiscParameterBuffer *misc_param;
     VAEncMiscParameterRateControl *misc_rate_ctrl;
 
-    context->seq_param.level_idc = 41 /*SH_LEVEL_3*/;
+    va_status = vaCreateBuffer(context->va_dpy, context->context_id,
+                               VAEncMiscParameterBufferType,
+                               sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterRateControl),
+                               1,NULL,&rc_param_buf);
+    CHECK_VASTATUS(va_status,"vaCreateBuffer");
+
+    vaMapBuffer(context->va_dpy, rc_param_buf,(void **)&misc_param);
+    misc_param->type = VAEncMiscParameterTypeRateControl;
+    misc_rate_ctrl = (VAEncMiscParameterRateControl *)misc_param->data;
+    memset(misc_rate_ctrl, 0, sizeof(*misc_rate_ctrl));
+    if (context->config.max_bitrate > context->config.frame_bitrate) {
+        /* bits_per_second is the peak, the target is a percentage of it */
+        misc_rate_ctrl->bits_per_second = context->config.max_bitrate;
+        misc_rate_ctrl->target_percentage = (unsigned long long)context->config.frame_bitrate * 100 / context->config.max_bitrate;
+    } else {
+        misc_rate_ctrl->bits_per_second = context->config.frame_bitrate;
+        misc_rate_ctrl->target_percentage = 66;
+    }
+    misc_rate_ctrl->window_size = 1000;
+    misc_rate_ctrl->initial_qp = context->config.initial_qp;
+    misc_rate_ctrl->min_qp = context->config.minimal_qp;
+    misc_rate_ctrl->basic_unit_size = 0;
+    misc_rate_ctrl->rc_flags.bits.reset = reset;
+    vaUnmapBuffer(context->va_dpy, rc_param_buf);
+
+    va_status = vaRenderPicture(context->va_dpy, context->context_id, &rc_param_buf, 1);
+    CHECK_VASTATUS(va_status,"vaRenderPicture");
+
+    return 0;
+}
+
+/*
+ * Frame rate misc parameter, so the rate controller budgets bits per frame
+ * for the real capture cadence.  Sent with every sequence and whenever
+ * setFrameRate changes the rate mid-stream.
+ */
+static int render_frame_rate(VA264Context * context)
+{
+    VABufferID fr_param_buf;
+    VAStatus va_status;
+    VAEncMiscParameterBuffer *misc_param;
+    VAEncMiscParameterFrameRate *misc_frame_rate;
+
+    va_status = vaCreateBuffer(context->va_dpy, context->context_id,
+                               VAEncMiscParameterBufferType,
+                               sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterFrameRate),
+                               1,NULL,&fr_param_buf);
+    CHECK_VASTATUS(va_status,"vaCreateBuffer");
+
+    vaMapBuffer(context->va_dpy, fr_param_buf,(void **)&misc_param);
+    misc_param->type = VAEncMiscParameterTypeFrameRate;
+    misc_frame_rate = (VAEncMiscParameterFrameRate *)misc_param->data;
+    memset(misc_frame_rate, 0, sizeof(*misc_frame_rate));
+    /* numerator in the low 16 bits, denominator in the high ones, 0 for 1 */
+    misc_frame_rate->framerate = context->config.frame_rate_num |
+                                 (context->config.frame_rate_den > 1 ? context->config.frame_rate_den << 16 : 0);
+    vaUnmapBuffer(context->va_dpy, fr_param_buf);
+
+    va_status = vaRenderPicture(context->va_dpy, context->context_id, &fr_param_buf, 1);
+    CHECK_VASTATUS(va_status,"vaRenderPicture");
+
+    return 0;
+}
+
+/*
+ * Cap on the coded size of the next picture, in bytes.  With multiple
+ * passes the driver re-encodes a picture that comes out too big, raising
+ * the QP by delta_qp[pass] each time; otherwise the cap only steers its
+ * rate control.
+ */
+static int render_max_frame_size(VA264Context * context, unsigned int max_frame_size, int passes)
+{
+    VABufferID mfs_param_buf;
+    VAStatus va_status;
+    VAEncMiscParameterBuffer *misc_param;
+    VAConfigAttribValMaxFrameSize caps;
+    int i;
+
+    caps.value = context->max_frame_size_caps;
+    if (caps.bits.multiple_pass && passes > 1) {
+        VAEncMiscParameterBufferMultiPassFrameSize *misc_multipass;
+
+        if (passes > VA264_MAX_FRAME_PASSES)
+            passes = VA264_MAX_FRAME_PASSES;
+        for (i = 0; i < passes; i++)
+            context->max_frame_delta_qp[i] = 2;
+
+        va_status = vaCreateBuffer(context->va_dpy, context->context_id,
+                                   VAEncMiscParameterBufferType,
+                                   sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterBufferMultiPassFrameSize),
+                                   1,NULL,&mfs_param_buf);
+        CHECK_VASTATUS(va_status,"vaCreateBuffer");
+
+        vaMapBuffer(context->va_dpy, mfs_param_buf,(void **)&misc_param);
+        misc_param->type = VAEncMiscParameterTypeMultiPassFrameSize;
+        misc_multipass = (VAEncMiscParameterBufferMultiPassFrameSize *)misc_param->data;
+        memset(misc_multipass, 0, sizeof(*misc_multipass));
+        misc_multipass->type = VAEncMiscParameterTypeMultiPassFrameSize;
+        misc_multipass->max_frame_size = max_frame_size;       /* bytes */
+        misc_multipass->num_passes = passes;
+        misc_multipass->delta_qp = context->max_frame_delta_qp;
+        vaUnmapBuffer(context->va_dpy, mfs_param_buf);
+    } else {
+        VAEncMiscParameterBufferMaxFrameSize *misc_max_frame_size;
+
+        va_status = vaCreateBuffer(context->va_dpy, context->context_id,
+                                   VAEncMiscParameterBufferType,
+                                   sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterBufferMaxFrameSize),
+                                   1,NULL,&mfs_param_buf);
+        CHECK_VASTATUS(va_status,"vaCreateBuffer");
+
+        vaMapBuffer(context->va_dpy, mfs_param_buf,(void **)&misc_param);
+        misc_param->type = VAEncMiscParameterTypeMaxFrameSize;
+        misc_max_frame_size = (VAEncMiscParameterBufferMaxFrameSize *)misc_param->data;
+        memset(misc_max_frame_size, 0, sizeof(*misc_max_frame_size));
+        misc_max_frame_size->type = VAEncMiscParameterTypeMaxFrameSize;
+        misc_max_frame_size->max_frame_size = max_frame_size * 8;   /* bits */
+        vaUnmapBuffer(context->va_dpy, mfs_param_buf);
+    }
+
+    va_status = vaRenderPicture(context->va_dpy, context->context_id, &mfs_param_buf, 1);
+    CHECK_VASTATUS(va_status,"vaRenderPicture");
+
+    return 0;
+}
+
+/*
+ * Regions of interest for the picture from input 'slot', as QP deltas or,
+ * under rate control, as priorities the driver turns into QP itself.
+ */
+static int render_roi(VA264Context * context, unsigned int slot)
+{
+    VABufferID roi_param_buf;
+    VAStatus va_status;
+    VAEncMiscParameterBuffer *misc_param;
+    VAEncMiscParameterBufferROI *misc_roi;
+
+    va_status = vaCreateBuffer(context->va_dpy, context->context_id,
+                               VAEncMiscParameterBufferType,
+                               sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterBufferROI),
+                               1,NULL,&roi_param_buf);
+    CHECK_VASTATUS(va_status,"vaCreateBuffer");
+
+    vaMapBuffer(context->va_dpy, roi_param_buf,(void **)&misc_param);
+    misc_param->type = VAEncMiscParameterTypeROI;
+    misc_roi = (VAEncMiscParameterBufferROI *)misc_param->data;
+    memset(misc_roi, 0, sizeof(*misc_roi));
+    misc_roi->num_roi = context->input_num_roi[slot];
+    misc_roi->max_delta_qp = 51;
+    misc_roi->min_delta_qp = -51;
+    misc_roi->roi = context->input_roi[slot];
+    misc_roi->roi_flags.bits.roi_value_is_qp_delta = context->input_roi_qp_delta[slot];
+    vaUnmapBuffer(context->va_dpy, roi_param_buf);
+
+    va_status = vaRenderPicture(context->va_dpy, context->context_id, &roi_param_buf, 1);
+    CHECK_VASTATUS(va_status,"vaRenderPicture");
+
+    return 0;
+}
+
+/*
+ * The QP map queued with the picture in 'slot'.  Under CQP the deltas are
+ * added to the QP this picture is actually coded with, under rate control
+ * the driver takes them as deltas.
+ */
+static int render_qp_map(VA264Context * context, unsigned int slot)
+{
+    int block = context->qp_block_size;
+    int blocks = ((context->frame_width_mbaligned + block - 1) / block) *
+                 ((context->frame_height_mbaligned + block - 1) / block);
+    int qp = context->frame_info.qp ? context->frame_info.qp : context->pic_param.pic_init_qp;
+    int cqp = (context->config.rc_mode == VA_RC_CQP);
+    VAEncQPBufferH264 *qp_buf;
+    VAStatus va_status;
+    int i;
+
+    if (context->qp_buf[slot] == VA_INVALID_ID) {
+        va_status = vaCreateBuffer(context->va_dpy, context->context_id, VAEncQPBufferType,
+                                   blocks * sizeof(VAEncQPBufferH264), 1, NULL, &context->qp_buf[slot]);
+        if (va_status != VA_STATUS_SUCCESS) {
+            context->qp_buf[slot] = VA_INVALID_ID;
+            fprintf(stderr, "vaCreateBuffer failed for the QP map, coding without it\n");
+            return -1;
+        }
+    }
+
+    va_status = vaMapBuffer(context->va_dpy, context->qp_buf[slot], (void **)&qp_buf);
+    CHECK_VASTATUS(va_status,"vaMapBuffer");
+    for (i = 0; i < blocks; i++) {
+        int value = context->qp_delta[slot][i];
+
+        if (cqp) {
+            value += qp;
+            value = value < 0 ? 0 : (value > 51 ? 51 : value);
+        }
+        qp_buf[i].qp = value;
+    }
+    vaUnmapBuffer(context->va_dpy, context->qp_buf[slot]);
+
+    va_status = vaRenderPicture(context->va_dpy, context->context_id, &context->qp_buf[slot], 1);
+    CHECK_VASTATUS(va_status,"vaRenderPicture");
+
+    return 0;
+}
+
+/*
+ * The stripe of macroblocks coded intra in the next picture.  The sweep
+ * moves on by a stripe every P frame and starts over after an intra frame.
+ */
+static int render_intra_refresh(VA264Context * context)
+{
+    VABufferID rir_param_buf;
+    VAStatus va_status;
+    VAEncMiscParameterBuffer *misc_param;
+    VAEncMiscParameterRIR *misc_rir;
+    int units, size;
+
+    units = intra_refresh_units(context, &size);
+
+    va_status = vaCreateBuffer(context->va_dpy, context->context_id,
+                               VAEncMiscParameterBufferType,
+                               sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterRIR),
+                               1,NULL,&rir_param_buf);
+    CHECK_VASTATUS(va_status,"vaCreateBuffer");
+
+    vaMapBuffer(context->va_dpy, rir_param_buf,(void **)&misc_param);
+    misc_param->type = VAEncMiscParameterTypeRIR;
+    misc_rir = (VAEncMiscParameterRIR *)misc_param->data;
+    memset(misc_rir, 0, sizeof(*misc_rir));
+    if (context->intra_refresh_mode == VA264_REFRESH_COLUMN)
+        misc_rir->rir_flags.bits.enable_rir_column = 1;
+    else
+        misc_rir->rir_flags.bits.enable_rir_row = 1;
+    misc_rir->intra_insertion_location = context->intra_refresh_pos;
+    misc_rir->intra_insert_size = size;
+    misc_rir->qp_delta_for_inserted_intra = 0;
+    vaUnmapBuffer(context->va_dpy, rir_param_buf);
+
+    va_status = vaRenderPicture(context->va_dpy, context->context_id, &rir_param_buf, 1);
+    CHECK_VASTATUS(va_status,"vaRenderPicture");
+
+    context->intra_refresh_pos += size;
+    if (context->intra_refresh_pos >= units)
+        context->intra_refresh_pos = 0;
+    return 0;
+}
+
+/*
+ * HRD buffer model, bounding how far a single frame (a keyframe in
+ * particular) may overshoot the average.
+ */
+static int render_hrd(VA264Context * context)
+{
+    VABufferID hrd_param_buf;
+    VAStatus va_status;
+    VAEncMiscParameterBuffer *misc_param;
+    VAEncMiscParameterHRD *misc_hrd;
+
+    va_status = vaCreateBuffer(context->va_dpy, context->context_id,
+                               VAEncMiscParameterBufferType,
+                               sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterHRD),
+                               1,NULL,&hrd_param_buf);
+    CHECK_VASTATUS(va_status,"vaCreateBuffer");
+
+    vaMapBuffer(context->va_dpy, hrd_param_buf,(void **)&misc_param);
+    misc_param->type = VAEncMiscParameterTypeHRD;
+    misc_hrd = (VAEncMiscParameterHRD *)misc_param->data;
+    memset(misc_hrd, 0, sizeof(*misc_hrd));
+    misc_hrd->buffer_size = context->config.hrd_buffer_size;
+    misc_hrd->initial_buffer_fullness = context->config.hrd_initial_fullness;
+    vaUnmapBuffer(context->va_dpy, hrd_param_buf);
+
+    va_status = vaRenderPicture(context->va_dpy, context->context_id, &hrd_param_buf, 1);
+    CHECK_VASTATUS(va_status,"vaRenderPicture");
+
+    return 0;
+}
+
+static int render_sequence(VA264Context * context)
+{
+    VABufferID seq_param_buf;
+    VAStatus va_status;
+
+    context->seq_param.level_idc = 41 /*SH_LEVEL_3*/;
     context->seq_param.picture_width_in_mbs = context->frame_width_mbaligned / 16;
     context->seq_param.picture_height_in_mbs = context->frame_height_mbaligned / 16;
     context->seq_param.bits_per_second = context->config.frame_bitrate;
@@ -1113,10 +1965,18 @@ static int render_sequence(VA264Context * context)
     context->seq_param.intra_idr_period = context->config.intra_idr_period;
     context->seq_param.ip_period = context->config.ip_period;
 
-    context->seq_param.max_num_ref_frames = num_ref_frames;
+    context->seq_param.max_num_ref_frames = num_ref_frames + context->ltr_count;
     context->seq_param.seq_fields.bits.frame_mbs_only_flag = 1;
-    context->seq_param.time_scale = 900;
-    context->seq_param.num_units_in_tick = 15; /* Tc = num_units_in_tick / time_sacle */
+    /* a frame is two field ticks: frame_rate = time_scale / (2 * num_units_in_tick) */
+    context->seq_param.num_units_in_tick = context->config.frame_rate_den;
+    context->seq_param.time_scale = context->config.frame_rate_num * 2;
+    /* the VUI sps_rbsp writes, for drivers that build the SPS themselves */
+    context->seq_param.vui_parameters_present_flag = 1;
+    context->seq_param.vui_fields.bits.aspect_ratio_info_present_flag = 0;
+    context->seq_param.vui_fields.bits.timing_info_present_flag = 1;
+    context->seq_param.vui_fields.bits.fixed_frame_rate_flag = 0;
+    context->seq_param.vui_fields.bits.low_delay_hrd_flag = 0;
+    context->seq_param.vui_fields.bits.bitstream_restriction_flag = 0;
     context->seq_param.seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4 = Log2MaxPicOrderCntLsb - 4;
     context->seq_param.seq_fields.bits.log2_max_frame_num_minus4 = Log2MaxFrameNum - 4;
     context->seq_param.seq_fields.bits.frame_mbs_only_flag = 1;
@@ -1137,31 +1997,20 @@ static int render_sequence(VA264Context * context)
                                sizeof(context->seq_param), 1, &context->seq_param, &seq_param_buf);
     CHECK_VASTATUS(va_status,"vaCreateBuffer");
 
-    va_status = vaCreateBuffer(context->va_dpy, context->context_id,
-                               VAEncMiscParameterBufferType,
-                               sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterRateControl),
-                               1,NULL,&rc_param_buf);
-    CHECK_VASTATUS(va_status,"vaCreateBuffer");
-
-    vaMapBuffer(context->va_dpy, rc_param_buf,(void **)&misc_param);
-    misc_param->type = VAEncMiscParameterTypeRateControl;
-    misc_rate_ctrl = (VAEncMiscParameterRateControl *)misc_param->data;
-    memset(misc_rate_ctrl, 0, sizeof(*misc_rate_ctrl));
-    misc_rate_ctrl->bits_per_second = context->config.frame_bitrate;
-    misc_rate_ctrl->target_percentage = 66;
-    misc_rate_ctrl->window_size = 1000;
-    misc_rate_ctrl->initial_qp = context->config.initial_qp;
-    misc_rate_ctrl->min_qp = context->config.minimal_qp;
-    misc_rate_ctrl->basic_unit_size = 0;
-    vaUnmapBuffer(context->va_dpy, rc_param_buf);
+    va_status = vaRenderPicture(context->va_dpy, context->context_id, &seq_param_buf, 1);
+    CHECK_VASTATUS(va_status,"vaRenderPicture");;
 
-    render_id[0] = seq_param_buf;
-    render_id[1] = rc_param_buf;
+    va_status = render_frame_rate(context);
+    if (va_status != VA_STATUS_SUCCESS)
+        return va_status;
 
-    va_status = vaRenderPicture(context->va_dpy, context->context_id, &render_id[0], 2);
-    CHECK_VASTATUS(va_status,"vaRenderPicture");;
+    if (context->config.hrd_buffer_size) {
+        va_status = render_hrd(context);
+        if (va_status != VA_STATUS_SUCCESS)
+            return va_status;
+    }
 
-    return 0;
+    return render_rate_control(context, 0);
 }
 
 static char *frametype_to_string(int ftype)
@@ -1182,15 +2031,14 @@ static char *frametype_to_string(int ftype)
 
 static int calc_poc(VA264Context * context, int pic_order_cnt_lsb)
 {
-    static int PicOrderCntMsb_ref = 0, pic_order_cnt_lsb_ref = 0;
     int prevPicOrderCntMsb, prevPicOrderCntLsb;
     int PicOrderCntMsb, TopFieldOrderCnt;
 
     if (context->current_frame_type == FRAME_IDR)
         prevPicOrderCntMsb = prevPicOrderCntLsb = 0;
     else {
-        prevPicOrderCntMsb = PicOrderCntMsb_ref;
-        prevPicOrderCntLsb = pic_order_cnt_lsb_ref;
+        prevPicOrderCntMsb = context->PicOrderCntMsb_ref;
+        prevPicOrderCntLsb = context->pic_order_cnt_lsb_ref;
     }
 
     if ((pic_order_cnt_lsb < prevPicOrderCntLsb) &&
@@ -1205,8 +2053,8 @@ static int calc_poc(VA264Context * context, int pic_order_cnt_lsb)
     TopFieldOrderCnt = PicOrderCntMsb + pic_order_cnt_lsb;
 
     if (context->current_frame_type != FRAME_B) {
-        PicOrderCntMsb_ref = PicOrderCntMsb;
-        pic_order_cnt_lsb_ref = pic_order_cnt_lsb;
+        context->PicOrderCntMsb_ref = PicOrderCntMsb;
+        context->pic_order_cnt_lsb_ref = pic_order_cnt_lsb;
     }
 
     return TopFieldOrderCnt;
@@ -1216,12 +2064,15 @@ static int render_picture(VA264Context * context)
 {
     VABufferID pic_param_buf;
     VAStatus va_status;
-    int i = 0;
+    int i = 0, j;
 
-    context->pic_param.CurrPic.picture_id = context->ref_surface[(context->current_frame_display % SURFACE_NUM)];
+    if (context->ltr_candidate >= 0)
+        context->pic_param.CurrPic.picture_id = context->ltr_surface[context->ltr_candidate];
+    else
+        context->pic_param.CurrPic.picture_id = context->ref_surface[(context->current_frame_display % SURFACE_NUM)];
     context->pic_param.CurrPic.frame_idx = context->current_frame_num;
     context->pic_param.CurrPic.flags = 0;
-    context->pic_param.CurrPic.TopFieldOrderCnt = calc_poc(context, (context->current_frame_display - context->current_IDR_display) % MaxPicOrderCntLsb);
+    context->pic_param.CurrPic.TopFieldOrderCnt = calc_poc(context, (context->current_frame_display - context->poc_display) % MaxPicOrderCntLsb);
     context->pic_param.CurrPic.BottomFieldOrderCnt = context->pic_param.CurrPic.TopFieldOrderCnt;
     context->CurrentCurrPic = context->pic_param.CurrPic;
 
@@ -1236,14 +2087,20 @@ static int render_picture(VA264Context * context)
         }
     } else {
         memcpy(context->pic_param.ReferenceFrames, context->ReferenceFrames, context->numShortTerm * sizeof(VAPictureH264));
-        for (i = context->numShortTerm; i < SURFACE_NUM; i++) {
+        i = context->numShortTerm;
+        /* the long-term references follow the short-term ones */
+        for (j = 0; j < context->ltr_count; j++)
+            if (!(context->ltr_pic[j].flags & VA_PICTURE_H264_INVALID))
+                context->pic_param.ReferenceFrames[i++] = context->ltr_pic[j];
+        for (; i < SURFACE_NUM; i++) {
             context->pic_param.ReferenceFrames[i].picture_id = VA_INVALID_SURFACE;
             context->pic_param.ReferenceFrames[i].flags = VA_PICTURE_H264_INVALID;
         }
     }
 
     context->pic_param.pic_fields.bits.idr_pic_flag = (context->current_frame_type == FRAME_IDR);
-    context->pic_param.pic_fields.bits.reference_pic_flag = (context->current_frame_type != FRAME_B);
+    context->pic_param.pic_fields.bits.reference_pic_flag = (context->current_frame_type != FRAME_B &&
+        !(context->temporal_layers && context->frame_info.temporal_id == context->temporal_layers - 1));
     context->pic_param.pic_fields.bits.entropy_coding_mode_flag = context->config.h264_entropy_mode;
     context->pic_param.pic_fields.bits.deblocking_filter_control_present_flag = 1;
     context->pic_param.frame_num = context->current_frame_num;
@@ -1299,6 +2156,43 @@ static int render_packedsequence(VA264Context * context)
     return 0;
 }
 
+static int render_packedsei(VA264Context * context)
+{
+    VAEncPackedHeaderParameterBuffer packedheader_param_buffer;
+    VABufferID packedsei_para_bufid, packedsei_data_bufid, render_id[2];
+    unsigned int length_in_bits;
+    unsigned char *packedsei_buffer = NULL;
+    VAStatus va_status;
+
+    length_in_bits = build_packed_sei_buffer(context, &packedsei_buffer);
+    packedheader_param_buffer.type = VAEncPackedHeaderH264_SEI;
+    packedheader_param_buffer.bit_length = length_in_bits;
+    packedheader_param_buffer.has_emulation_bytes = 0;
+
+    va_status = vaCreateBuffer(context->va_dpy,
+                               context->context_id,
+                               VAEncPackedHeaderParameterBufferType,
+                               sizeof(packedheader_param_buffer), 1, &packedheader_param_buffer,
+                               &packedsei_para_bufid);
+    CHECK_VASTATUS(va_status,"vaCreateBuffer");
+
+    va_status = vaCreateBuffer(context->va_dpy,
+                               context->context_id,
+                               VAEncPackedHeaderDataBufferType,
+                               (length_in_bits + 7) / 8, 1, packedsei_buffer,
+                               &packedsei_data_bufid);
+    CHECK_VASTATUS(va_status,"vaCreateBuffer");
+
+    render_id[0] = packedsei_para_bufid;
+    render_id[1] = packedsei_data_bufid;
+    va_status = vaRenderPicture(context->va_dpy, context->context_id, render_id, 2);
+    CHECK_VASTATUS(va_status,"vaRenderPicture");
+
+    free(packedsei_buffer);
+
+    return 0;
+}
+
 static int render_packedpicture(VA264Context * context)
 {
     VAEncPackedHeaderParameterBuffer packedheader_param_buffer;
@@ -1384,8 +2278,23 @@ static int render_slice(VA264Context * context)
     context->slice_param.num_macroblocks = context->frame_width_mbaligned * context->frame_height_mbaligned / (16 * 16); /* Measured by MB */
     context->slice_param.slice_type = (context->current_frame_type == FRAME_IDR) ? 2 : context->current_frame_type;
     if (context->current_frame_type == FRAME_IDR) {
-        if (context->current_frame_encoding != 0)
+        /* consecutive IDR pictures need different ids, forced ones included */
+        if (context->frames_coded > 1)
             ++context->slice_param.idr_pic_id;
+    } else if (context->current_frame_type == FRAME_P && context->ltr_recovering >= 0) {
+        /* a single reference, the long-term one reportFrameLoss picked */
+        context->slice_param.RefPicList0[0] = context->ltr_pic[context->ltr_recovering];
+        for (i = 1; i < 32; i++) {
+            context->slice_param.RefPicList0[i].picture_id = VA_INVALID_SURFACE;
+            context->slice_param.RefPicList0[i].flags = VA_PICTURE_H264_INVALID;
+        }
+    } else if (context->current_frame_type == FRAME_P && context->temporal_ref >= 0) {
+        /* a single reference of a lower layer, see plan_temporal_layer */
+        context->slice_param.RefPicList0[0] = context->ReferenceFrames[context->temporal_ref];
+        for (i = 1; i < 32; i++) {
+            context->slice_param.RefPicList0[i].picture_id = VA_INVALID_SURFACE;
+            context->slice_param.RefPicList0[i].flags = VA_PICTURE_H264_INVALID;
+        }
     } else if (context->current_frame_type == FRAME_P) {
         int refpiclist0_max = context->h264_maxref & 0xffff;
         memcpy(context->slice_param.RefPicList0, context->RefPicList0_P, ((refpiclist0_max > 32) ? 32 : refpiclist0_max)*sizeof(VAPictureH264));
@@ -1411,10 +2320,15 @@ static int render_slice(VA264Context * context)
         }
     }
 
+    context->slice_param.num_ref_idx_active_override_flag = (context->ltr_recovering >= 0 || context->temporal_ref >= 0);
+    context->slice_param.num_ref_idx_l0_active_minus1 = 0;
+
+    /* the picture QP under software rate control, pic_init_qp otherwise */
+    context->slice_param.slice_qp_delta = context->frame_info.qp ? context->frame_info.qp - context->pic_param.pic_init_qp : 0;
     context->slice_param.slice_alpha_c0_offset_div2 = 0;
     context->slice_param.slice_beta_offset_div2 = 0;
     context->slice_param.direct_spatial_mv_pred_flag = 1;
-    context->slice_param.pic_order_cnt_lsb = (context->current_frame_display - context->current_IDR_display) % MaxPicOrderCntLsb;
+    context->slice_param.pic_order_cnt_lsb = (context->current_frame_display - context->poc_display) % MaxPicOrderCntLsb;
 
 
     if (context->h264_packedheader &&
@@ -1431,17 +2345,33 @@ static int render_slice(VA264Context * context)
     return 0;
 }
 
-static int release_encode(VA264Context * context)
+static void release_context(VA264Context * context)
 {
     int i;
 
-    vaDestroySurfaces(context->va_dpy, &context->src_surface[0], SURFACE_NUM);
-    vaDestroySurfaces(context->va_dpy, &context->ref_surface[0], SURFACE_NUM);
-
-    for (i = 0; i < SURFACE_NUM; i++)
+    for (i = 0; i < SURFACE_NUM; i++) {
         vaDestroyBuffer(context->va_dpy, context->coded_buf[i]);
+        if (context->qp_buf[i] != VA_INVALID_ID)
+            vaDestroyBuffer(context->va_dpy, context->qp_buf[i]);
+        free(context->qp_delta[i]);
+    }
 
     vaDestroyContext(context->va_dpy, context->context_id);
+}
+
+static void release_surfaces(VA264Context * context)
+{
+    vaDestroySurfaces(context->va_dpy, &context->src_surface[0], SURFACE_NUM);
+    vaDestroySurfaces(context->va_dpy, &context->ref_surface[0], SURFACE_NUM);
+    if (context->ltr_surfaces)
+        vaDestroySurfaces(context->va_dpy, &context->ltr_surface[0], VA264_LTR_SURFACES);
+    context->ltr_surfaces = 0;
+}
+
+static int release_encode(VA264Context * context)
+{
+    release_surfaces(context);
+    release_context(context);
     vaDestroyConfig(context->va_dpy, context->config_id);
 
     return 0;
@@ -1449,9 +2379,8 @@ static int release_encode(VA264Context * context)
 
 static int deinit_va(VA264Context * context)
 {
-    vaTerminate(context->va_dpy);
-
-    va_close_display(context->va_dpy);
+    va_release_display(context->va_dpy);
+    context->va_dpy = NULL;
 
     return 0;
 }
@@ -1459,24 +2388,85 @@ static int deinit_va(VA264Context * context)
 void destroyContext(void * context)
 {
     VA264Context * ctx = (VA264Context *)context;
+    if (ctx->event_fd >= 0)
+        encodeEventFdClose(ctx);
     if(ctx->encoded_buffer)
     {
         free(ctx->encoded_buffer);
         ctx->encoded_buffer = 0;
     }
+    free(ctx->batch_buffer);
+    if (ctx->scene_cut_mode)
+        sceneCutDestroy(&ctx->scene_cut);
     release_encode(ctx);
     deinit_va(ctx);
     free(ctx);
 }
 
-void * createContext(int width, int height, int bitrate, int intra_period, int idr_period, int ip_period, int frame_rate, int profile, int rc_mode)
+/*
+ * The frame rate as num/den frames per second, e.g. 30000/1001 for NTSC,
+ * or VA264_DEFAULT_FRAME_RATE when it isn't given.  Both terms must fit the
+ * 16 bits the VA frame rate parameter has for each.
+ */
+static void set_frame_rate(VA264Config * config, int num, int den)
+{
+    if (num <= 0 || den <= 0 || num > 0xffff || den > 0xffff) {
+        num = (num > 0 && den > 0) ? (num + den / 2) / den : VA264_DEFAULT_FRAME_RATE;
+        den = 1;
+    }
+    if (num <= 0 || num > 0xffff)
+        num = VA264_DEFAULT_FRAME_RATE;
+    config->frame_rate_num = num;
+    config->frame_rate_den = den;
+    config->frame_rate = (num + den / 2) / den;
+    if (config->frame_rate < 1)
+        config->frame_rate = 1;
+}
+
+static int check_gop_config(VA264Config * config)
+{
+    if (config->ip_period < 1) {
+        printf(" ip_period must be greater than 0\n");
+        return -1;
+    }
+    if (config->intra_period != 1 && config->intra_period % config->ip_period != 0) {
+        printf(" intra_period must be a multiplier of ip_period\n");
+        return -1;
+    }
+    if (config->intra_period != 0 && config->intra_idr_period % config->intra_period != 0) {
+        printf(" idr_period must be a multiplier of intra_period\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void set_frame_size(VA264Context * context)
+{
+    context->frame_width_mbaligned = (context->config.frame_width + 15) & (~15);
+    context->frame_height_mbaligned = (context->config.frame_height + 15) & (~15);
+    if (context->config.frame_width != context->frame_width_mbaligned ||
+        context->config.frame_height != context->frame_height_mbaligned) {
+        printf("Source frame is %dx%d and will code clip to %dx%d with crop\n",
+               context->config.frame_width, context->config.frame_height,
+               context->frame_width_mbaligned, context->frame_height_mbaligned
+               );
+    }
+}
+
+void * createContextOnDevice(int placement, const char * device, int width, int height, int bitrate, int intra_period, int idr_period, int ip_period, int frame_rate, int profile, int rc_mode)
 {
     VA264Context * context = (VA264Context*)malloc(sizeof(VA264Context));
     memset((void*)context, 0, sizeof(VA264Context));
+    context->placement = placement;
+    context->sync_mode = VA264_SYNC_BLOCKING;
+    context->poll_interval_us = 200;
+    context->event_fd = -1;
+    if (device)
+        snprintf(context->device, sizeof(context->device), "%s", device);
     context->config.h264_entropy_mode = 1; // cabac
     context->config.frame_width = width;
     context->config.frame_height = height;
-    context->config.frame_rate = frame_rate;
+    set_frame_rate(&context->config, frame_rate, 1);
     context->config.frame_bitrate = bitrate;
     context->config.initial_qp = 26;
     context->config.minimal_qp = 0;
@@ -1487,18 +2477,7 @@ void * createContext(int width, int height, int bitrate, int intra_period, int i
     context->h264_maxref = (1<<16|1);
     context->requested_entrypoint = context->selected_entrypoint = -1;
 
-    if (context->config.ip_period < 1) {
-        printf(" ip_period must be greater than 0\n");
-        free(context);
-        return NULL;
-    }
-    if (context->config.intra_period != 1 && context->config.intra_period % context->config.ip_period != 0) {
-        printf(" intra_period must be a multiplier of ip_period\n");
-        free(context);
-        return NULL;
-    }
-    if (context->config.intra_period != 0 && context->config.intra_idr_period % context->config.intra_period != 0) {
-        printf(" idr_period must be a multiplier of intra_period\n");
+    if (check_gop_config(&context->config) != 0) {
         free(context);
         return NULL;
     }
@@ -1511,26 +2490,22 @@ void * createContext(int width, int height, int bitrate, int intra_period, int i
     // one of: VAProfileH264ConstrainedBaseline, VAProfileH264Main, VAProfileH264High
     context->config.h264_profile = profile;
 
-    context->frame_width_mbaligned = (context->config.frame_width + 15) & (~15);
-    context->frame_height_mbaligned = (context->config.frame_height + 15) & (~15);
-    if (context->config.frame_width != context->frame_width_mbaligned ||
-        context->config.frame_height != context->frame_height_mbaligned) {
-        printf("Source frame is %dx%d and will code clip to %dx%d with crop\n",
-               context->config.frame_width, context->config.frame_height,
-               context->frame_width_mbaligned, context->frame_height_mbaligned
-               );
-    }
+    set_frame_size(context);
 
     // the buffer to receive the encoded frames from encodeImage
     context->encoded_buffer = (uint8_t*)malloc(context->frame_width_mbaligned * context->frame_height_mbaligned * 3);
     
     if(init_va(context) != VA_STATUS_SUCCESS) {
+        deinit_va(context);
         free(context->encoded_buffer);
+        free(context);
         return NULL;
     }
     
     if(setup_encode(context) != VA_STATUS_SUCCESS) {
+        deinit_va(context);
         free(context->encoded_buffer);
+        free(context);
         return NULL;
     }
 
@@ -1542,32 +2517,497 @@ void * createContext(int width, int height, int bitrate, int intra_period, int i
     return (void*)context;
 }
 
-uint8_t * encodeImage(void * ctx, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int * encodedsize, bool forceIDR)
+void * createContext(int width, int height, int bitrate, int intra_period, int idr_period, int ip_period, int frame_rate, int profile, int rc_mode)
 {
-    VA264Context * context = (VA264Context *)ctx;
+    return createContextOnDevice(VA264_PLACEMENT_LEAST_SESSIONS, NULL, width, height, bitrate, intra_period, idr_period, ip_period, frame_rate, profile, rc_mode);
+}
 
-    if(forceIDR) {
-        // reset the sequence to start with a new IDR regardless of layout
-        context->current_frame_num = context->current_frame_display = context->current_frame_encoding = 0;
+/*
+ * Change the stream parameters of an open context.  The display is kept,
+ * the VA config is only recreated when the profile or rate control mode
+ * changes and the surfaces only when the macroblock-aligned size does.
+ * The next frame starts a new sequence with an IDR, unless only the
+ * bitrate or frame rate changed, which goes through setBitrate and
+ * setFrameRate instead.  Frames held back for B frame reordering must be
+ * drained with encodeFlush first.  Fails on a context owned by an engine,
+ * whose buffers are sized for the frame, and when intra refresh is on and
+ * the new setup can't keep it; setIntraRefresh(ctx, VA264_REFRESH_OFF, 0)
+ * first to go back to periodic intra frames.  Returns 0 on success; if the new
+ * VA objects can't be created the context is unusable and must be
+ * destroyed.
+ */
+int reconfigureContext(void * ctx, int width, int height, int bitrate, int intra_period, int idr_period, int ip_period, int frame_rate, int profile, int rc_mode)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    VA264Config old = context->config;
+    int old_width_mbaligned = context->frame_width_mbaligned;
+    int old_height_mbaligned = context->frame_height_mbaligned;
+    /* under software rate control the config holds CQP, compare against what was asked for */
+    int old_rc_mode = context->soft_rc_mode ? context->soft_rc_mode : old.rc_mode;
+    int new_config, new_surfaces;
+    uint8_t * encoded_buffer;
+
+    if (context->engine_attached)
+        return -1;
+    if (frame_rate <= 0)
+        frame_rate = VA264_DEFAULT_FRAME_RATE;
+
+    /* a rate change alone needs neither a new sequence nor new VA objects */
+    if (width == old.frame_width && height == old.frame_height &&
+        intra_period == old.intra_period && idr_period == old.intra_idr_period &&
+        ip_period == old.ip_period && profile == old.h264_profile && rc_mode == old_rc_mode) {
+        if (frame_rate != old.frame_rate_num || old.frame_rate_den != 1)
+            setFrameRate(context, frame_rate);
+        if (bitrate == 0)
+            bitrate = width * height * 12 * frame_rate / 50;
+        if ((unsigned int)bitrate != old.frame_bitrate)
+            setBitrate(context, bitrate, old.max_bitrate);
+        return 0;
     }
 
-    uint8_t * output = context->encoded_buffer;
-    VASurfaceID surface = context->src_surface[context->current_frame_encoding % SURFACE_NUM];
-    int retv = upload_surface_yuv(context->va_dpy, surface, fourcc, context->config.frame_width, context->config.frame_height, y, u, v);
-    CHECK_VASTATUS_RETNULL(retv,"encodeImage");
-
-    encoding2display_order(context->current_frame_encoding, context->config.intra_period, context->config.intra_idr_period, context->config.ip_period,
-                               &context->current_frame_display, &context->current_frame_type);
+    if (context->picture_pending || context->frames_pending)
+        return -1;
 
-    if (context->current_frame_type == FRAME_IDR) 
-    {
+    context->config.frame_width = width;
+    context->config.frame_height = height;
+    set_frame_rate(&context->config, frame_rate, 1);
+    context->config.frame_bitrate = bitrate;
+    __atomic_store_n(&context->rc_update, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&context->fr_update, 0, __ATOMIC_RELAXED);
+    context->config.intra_period = intra_period;
+    context->config.intra_idr_period = idr_period;
+    context->config.ip_period = ip_period;
+    context->config.rc_mode = rc_mode;
+    context->config.h264_profile = profile;
+
+    if (check_gop_config(&context->config) != 0) {
+        context->config = old;
+        return -1;
+    }
+    if (context->config.frame_bitrate == 0)
+        context->config.frame_bitrate = width * height * 12 * frame_rate / 50;
+
+    /* probe before tearing anything down, so an unsupported profile leaves the context as it was */
+    new_config = (profile != old.h264_profile || rc_mode != old_rc_mode);
+    if (new_config && probe_config(context) != VA_STATUS_SUCCESS) {
+        context->config = old;
+        context->config.rc_mode = old_rc_mode;
+        probe_config(context);
+        return -1;
+    }
+    /* intra refresh stays on, or the caller turns it off first */
+    if (context->intra_refresh_mode && !intra_refresh_supported(context, context->intra_refresh_mode)) {
+        context->config = old;
+        if (new_config) {
+            context->config.rc_mode = old_rc_mode;
+            probe_config(context);
+        }
+        return -1;
+    }
+    /* long-term references and temporal layers are kept for P-only streams */
+    if (ip_period != 1) {
+        context->ltr_count = 0;
+        context->temporal_layers = 0;
+    }
+
+    set_frame_size(context);
+    new_surfaces = (context->frame_width_mbaligned != old_width_mbaligned ||
+                    context->frame_height_mbaligned != old_height_mbaligned);
+
+    if (new_surfaces) {
+        encoded_buffer = (uint8_t *)realloc(context->encoded_buffer, context->frame_width_mbaligned * context->frame_height_mbaligned * 3);
+        if (!encoded_buffer)
+            return -1;
+        context->encoded_buffer = encoded_buffer;
+    }
+
+    /* the encode context is bound to both the config and the render targets */
+    if (new_config || new_surfaces) {
+        /* a QP map set for the next frame goes with the pool, it was sized for the old frame */
+        context->next_qp_map = 0;
+        release_context(context);
+        if (new_surfaces) {
+            release_surfaces(context);
+            if (setup_surfaces(context) != VA_STATUS_SUCCESS)
+                return -1;
+        }
+        if (new_config) {
+            vaDestroyConfig(context->va_dpy, context->config_id);
+            if (setup_config(context) != VA_STATUS_SUCCESS)
+                return -1;
+        }
+        if (setup_context(context) != VA_STATUS_SUCCESS)
+            return -1;
+    }
+
+    if (context->soft_rc_mode)
+        setup_soft_rc(context);
+    /* the detector is sized for the frame, and a new sequence has no previous frame to compare */
+    if (context->scene_cut_mode && setSceneCutDetection(context, context->scene_cut_mode) != 0)
+        return -1;
+    /* the sweep restarts with the new sequence */
+    context->intra_refresh_pos = 0;
+
+    /* restart the GOP layout with a new SPS at the next input */
+    context->plan_count = context->plan_next = 0;
+    context->gop_restart = 1;
+    context->idr_requested = 0;
+    return 0;
+}
+
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Turn the requests made with requestKeyFrame into at most one keyframe.
+ * Requests made while one is on its way, or within the window after one,
+ * were most likely sent before the receiver got it and are dropped.  The
+ * rest wait until the minimum interval since the last keyframe is over.
+ */
+static void take_keyframe_requests(VA264Context * context)
+{
+    double since = monotonic_seconds() - context->keyframe_time;
+
+    if (__atomic_exchange_n(&context->keyframe_requests, 0, __ATOMIC_ACQUIRE) &&
+        !context->idr_requested && !context->intra_requested &&
+        !(context->frames_coded && since < context->keyframe_window))
+        context->keyframe_pending = 1;
+
+    if (!context->keyframe_pending || (context->frames_coded && since < context->keyframe_min_interval))
+        return;
+    context->keyframe_pending = 0;
+    /* long-term references would reach back across the recovery point */
+    if (context->keyframe_mode == VA264_KEYFRAME_I && context->frames_coded && !context->ltr_count)
+        context->intra_requested = 1;
+    else
+        context->idr_requested = 1;
+}
+
+/*
+ * Frames arrive in display order and are uploaded to the source surface of
+ * their display slot, then coded in coding order once every frame the next
+ * picture needs has arrived.  With B frames this keeps ip_period - 1 frames
+ * queued; the DTS of each picture trails the PTS of the input at the same
+ * position by that reorder delay.
+ */
+static VAStatus queue_input(VA264Context * context, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int64_t pts, bool forceIDR)
+{
+    unsigned int slot = context->current_frame_input % SURFACE_NUM;
+
+    /* a keyframe request takes effect at the next anchor picture */
+    if (forceIDR)
+        context->idr_requested = 1;
+    take_keyframe_requests(context);
+
+    /* without a frame the caller has already filled nextSourceSurface() */
+    if (y) {
+        int retv = upload_surface_yuv(context->va_dpy, context->src_surface[slot], fourcc, context->config.frame_width, context->config.frame_height, y, u, v);
+        CHECK_VASTATUS(retv,"upload_surface_yuv");
+
+    }
+
+    /* content signals for the GOP planner, unknown for frames the caller uploaded */
+    context->input_cut[slot] = 0;
+    context->input_sad[slot] = -1;
+    if (y && context->scene_cut_mode) {
+        context->input_cut[slot] = sceneCutAnalyze(&context->scene_cut, y, context->config.frame_width);
+        if (context->scene_cut.frames > 1)
+            context->input_sad[slot] = context->scene_cut.sad;
+    }
+
+    context->input_pts[slot] = pts;
+    context->input_max_frame_size[slot] = context->next_max_frame_size;
+    context->next_max_frame_size = 0;
+    context->input_qp_map[slot] = context->next_qp_map;
+    context->next_qp_map = 0;
+    context->input_num_roi[slot] = context->next_num_roi;
+    if (context->next_num_roi) {
+        memcpy(context->input_roi[slot], context->next_roi, context->next_num_roi * sizeof(VAEncROI));
+        context->input_roi_qp_delta[slot] = context->next_roi_qp_delta;
+        context->next_num_roi = 0;
+    }
+    context->current_frame_input++;
+    context->frames_pending++;
+    return VA_STATUS_SUCCESS;
+}
+
+#define GOP_STATIC_SAD      0.5     /* mean block difference of a frame with nothing moving */
+#define GOP_MOTION_MEDIUM   5.0     /* one B frame at most */
+#define GOP_MOTION_HIGH     10.0    /* no B frames */
+
+static int frame_is_static(VA264Context * context, unsigned long long display)
+{
+    float sad = context->input_sad[display % SURFACE_NUM];
+
+    return sad >= 0 && sad < GOP_STATIC_SAD;
+}
+
+/*
+ * Type of an intra or anchor picture at 'display', the first frame not
+ * coded yet or the anchor of the mini-GOP that starts there.
+ */
+static int plan_anchor_type(VA264Context * context, unsigned long long display, int first)
+{
+    VA264Config * config = &context->config;
+    unsigned long long since_idr = display - context->current_IDR_display;
+    unsigned long long since_intra = display - context->last_intra_display;
+
+    if (first) {
+        if (context->frames_coded == 0 || context->gop_restart || context->idr_requested)
+            return FRAME_IDR;
+        if (context->input_cut[display % SURFACE_NUM])
+            return (context->scene_cut_mode == VA264_SCENECUT_I) ? FRAME_I : FRAME_IDR;
+        if (context->intra_requested)
+            return FRAME_I;
+    }
+
+    /* the refresh sweeps take the place of periodic intra frames */
+    if (context->intra_refresh_mode)
+        return FRAME_P;
+
+    if (first) {
+        if (config->intra_idr_period && since_idr >= (unsigned long long)config->intra_idr_period)
+            return FRAME_IDR;
+        if (context->adaptive_gop && since_idr >= (unsigned long long)context->max_gop)
+            return FRAME_IDR;
+    }
+
+    if (config->intra_period == 1)
+        return FRAME_I;
+    if (config->intra_period && since_intra >= (unsigned long long)config->intra_period) {
+        /* nothing has moved since the last I frame, it would only cost bits */
+        if (context->adaptive_gop && context->gop_static && frame_is_static(context, display))
+            return FRAME_P;
+        return FRAME_I;
+    }
+    return FRAME_P;
+}
+
+/*
+ * Plan the next mini-GOP: an anchor picture followed, in coding order, by
+ * the B frames displayed before it.  Every frame before the oldest one
+ * pending has been coded at this point.  Returns 0 if more input is needed.
+ */
+static int plan_mini_gop(VA264Context * context, int flushing)
+{
+    VA264Config * config = &context->config;
+    unsigned long long oldest = context->current_frame_input - context->frames_pending;
+    unsigned long long anchor, due;
+    int length, type, i;
+    double motion = 0;
+    int measured = 0;
+
+    if (context->frames_pending == 0)
+        return 0;
+    if (!flushing && context->frames_pending < config->ip_period)
+        return 0;
+
+    context->plan_count = context->plan_next = 0;
+
+    /* IDR and scene cut pictures stand alone */
+    type = plan_anchor_type(context, oldest, 1);
+    if (type == FRAME_IDR || type == FRAME_I) {
+        if (type == FRAME_IDR) {
+            context->idr_requested = 0;
+            context->gop_restart = 0;
+        } else if (context->intra_requested) {
+            context->keyframe_recovery = 1;
+        }
+        context->intra_requested = 0;
+        context->plan_display[0] = oldest;
+        context->plan_type[0] = type;
+        context->plan_count = 1;
+        return 1;
+    }
+
+    length = config->ip_period < context->frames_pending ? config->ip_period : context->frames_pending;
+
+    /* B frames can't reach across a scene cut or an IDR that is due */
+    for (i = 1; i < length; i++) {
+        if (context->input_cut[(oldest + i) % SURFACE_NUM]) {
+            length = i;
+            break;
+        }
+    }
+    if (config->intra_idr_period) {
+        due = context->current_IDR_display + config->intra_idr_period;
+        if (due - oldest < (unsigned long long)length)
+            length = due - oldest;
+    }
+    if (context->adaptive_gop) {
+        due = context->current_IDR_display + context->max_gop;
+        if (due - oldest < (unsigned long long)length)
+            length = due - oldest;
+    }
+    /* and the anchor lands on a periodic I frame */
+    if (config->intra_period > 1) {
+        due = context->last_intra_display + config->intra_period;
+        if (due >= oldest && due - oldest + 1 < (unsigned long long)length)
+            length = due - oldest + 1;
+    }
+
+    /* B frames don't pay off when there is a lot of motion */
+    if (context->adaptive_gop && length > 1) {
+        for (i = 0; i < length; i++) {
+            float sad = context->input_sad[(oldest + i) % SURFACE_NUM];
+
+            if (sad >= 0) {
+                motion += sad;
+                measured++;
+            }
+        }
+        if (measured)
+            motion /= measured;
+        if (motion > GOP_MOTION_HIGH)
+            length = 1;
+        else if (motion > GOP_MOTION_MEDIUM && length > 2)
+            length = 2;
+    }
+
+    anchor = oldest + length - 1;
+    context->plan_display[0] = anchor;
+    context->plan_type[0] = plan_anchor_type(context, anchor, 0);
+    for (i = 0; i < length - 1; i++) {
+        context->plan_display[i + 1] = oldest + i;
+        context->plan_type[i + 1] = FRAME_B;
+    }
+    context->plan_count = length;
+    return 1;
+}
+
+/*
+ * Pick the next picture in coding order.  Returns 0 if it needs a frame
+ * that hasn't arrived yet.  When flushing, the frames left behind are coded
+ * as a shorter mini-GOP, after which the next input starts a new GOP.
+ */
+static int next_picture(VA264Context * context, int flushing)
+{
+    unsigned long long display, coded;
+    int frame_type, delay;
+
+    /* set by plan_mini_gop for a requested I frame, which is coded next */
+    context->keyframe_recovery = 0;
+    if (context->plan_next == context->plan_count && !plan_mini_gop(context, flushing))
+        return 0;
+
+    display = context->plan_display[context->plan_next];
+    frame_type = context->plan_type[context->plan_next];
+    context->plan_next++;
+
+    context->current_frame_display = display;
+    context->current_frame_type = frame_type;
+    context->frames_pending--;
+
+    if (frame_type == FRAME_IDR) {
         context->numShortTerm = 0;
         context->current_frame_num = 0;
-        context->current_IDR_display = context->current_frame_display;
+        context->current_IDR_display = display;
+        context->poc_display = display;
+        context->hrd_idr_coded = context->frames_coded;
+    }
+    if (frame_type == FRAME_IDR || context->keyframe_recovery)
+        context->keyframe_time = monotonic_seconds();
+    if (frame_type == FRAME_IDR || frame_type == FRAME_I) {
+        context->last_intra_display = display;
+        context->gop_static = 1;
+    } else if (!frame_is_static(context, display)) {
+        context->gop_static = 0;
+    }
+
+    /* every input before this position has been coded, so its PTS is still queued */
+    coded = context->current_frame_input - context->frames_pending - 1;
+    if (frame_type == FRAME_IDR) {
+        delay = context->config.ip_period - 1;
+        if (delay > context->frames_pending)
+            delay = context->frames_pending;
+        context->dts_delay = context->input_pts[(coded + delay) % SURFACE_NUM] - context->input_pts[coded % SURFACE_NUM];
     }
+    context->frame_info.pts = context->input_pts[display % SURFACE_NUM];
+    context->frame_info.dts = context->input_pts[coded % SURFACE_NUM] - context->dts_delay;
+    if (context->frames_coded > 0 && context->frame_info.dts <= context->last_dts)
+        context->frame_info.dts = context->last_dts + 1;
+    context->frame_info.frame_type = frame_type;
+    /* a requested I frame is a recovery point, with the parameter sets, where a decoder can join */
+    context->frame_info.keyframe = (frame_type == FRAME_IDR || context->keyframe_recovery);
+    context->frame_info.size_overflow = false;
+    context->frame_info.qp = 0;
+    context->frame_info.frame_id = display;
+    context->frame_info.long_term = false;
+    context->frame_info.temporal_id = 0;
+    context->frame_info.psnr_y = context->frame_info.psnr = context->frame_info.ssim = 0;
+    context->last_dts = context->frame_info.dts;
+    context->frames_coded++;
+    context->current_frame_encoding++;
+
+    /* the end of a stream, the next input starts a new GOP */
+    if (flushing && context->frames_pending == 0)
+        context->gop_restart = 1;
+    return 1;
+}
+
+/*
+ * Queue the encode of the next picture on the GPU without waiting for it.
+ */
+static VAStatus render_next_picture(VA264Context * context, int flushing)
+{
+    int rc_update, fr_update, passes;
+    unsigned int max_frame_size;
+
+    if (!next_picture(context, flushing))
+        return VA_STATUS_SUCCESS;
+
+    /* pick up a bitrate change made from another thread, see setBitrate */
+    rc_update = __atomic_exchange_n(&context->rc_update, 0, __ATOMIC_ACQUIRE);
+    if (rc_update) {
+        uint64_t rates = __atomic_load_n(&context->next_bitrate, __ATOMIC_RELAXED);
+
+        context->config.frame_bitrate = (unsigned int)(rates >> 32);
+        context->config.max_bitrate = (unsigned int)rates;
+    }
+    fr_update = __atomic_exchange_n(&context->fr_update, 0, __ATOMIC_ACQUIRE);
+    if (fr_update) {
+        uint64_t rate = __atomic_load_n(&context->next_frame_rate, __ATOMIC_RELAXED);
+
+        set_frame_rate(&context->config, (int)(rate >> 32), (int)(rate & 0xffffffff));
+    }
+
+    if (context->soft_rc_mode) {
+        if (rc_update || fr_update)
+            rateControlSetRate(&context->soft_rc, context->config.frame_bitrate, context->config.max_bitrate,
+                               (double)context->config.frame_rate_num / context->config.frame_rate_den);
+        context->frame_info.qp = rateControlFrameQP(&context->soft_rc, context->current_frame_type);
+    }
+
+    /* a per-frame cap overrides the global one for this picture only */
+    max_frame_size = context->input_max_frame_size[context->current_frame_display % SURFACE_NUM];
+    if (!max_frame_size)
+        max_frame_size = __atomic_load_n(&context->config.max_frame_size, __ATOMIC_RELAXED);
+    passes = __atomic_load_n(&context->config.max_frame_passes, __ATOMIC_RELAXED);
+    if (!context->max_frame_size_caps)
+        max_frame_size = 0;
+
+    plan_references(context);
+    if (context->keyframe_recovery)
+        drop_short_term(context);
+    plan_temporal_layer(context);
+
+    context->intra_refresh_start = 0;
+    if (context->intra_refresh_mode) {
+        if (context->current_frame_type == FRAME_P)
+            context->intra_refresh_start = (context->intra_refresh_pos == 0 && packed_sei(context));
+        else
+            context->intra_refresh_pos = 0;
+    }
+
+    context->submit_time = monotonic_seconds();
 
     VAStatus va_status = vaBeginPicture(context->va_dpy, context->context_id, context->src_surface[(context->current_frame_display % SURFACE_NUM)]);
-    CHECK_VASTATUS_RETNULL(va_status,"vaBeginPicture");
+    CHECK_VASTATUS(va_status,"vaBeginPicture");
 
     if (context->current_frame_type == FRAME_IDR) {
         render_sequence(context);
@@ -1576,35 +3016,1105 @@ uint8_t * encodeImage(void * ctx, int fourcc, uint8_t * y, uint8_t * u, uint8_t
             render_packedsequence(context);
             render_packedpicture(context);
         }
+        if (hrd_in_vui(context))
+            render_packedsei(context);
     } else {
+        /* an IDR carries the new rates in its sequence parameters anyway */
+        if (fr_update)
+            render_frame_rate(context);
+        if (rc_update)
+            render_rate_control(context, 1);
         render_picture(context);
+        /* a decoder joining at a recovery point needs the parameter sets */
+        if (context->intra_refresh_start || context->keyframe_recovery) {
+            render_packedsequence(context);
+            render_packedpicture(context);
+        }
+        if (hrd_in_vui(context) || context->intra_refresh_start || context->keyframe_recovery)
+            render_packedsei(context);
+        if (context->current_frame_type == FRAME_P && context->intra_refresh_mode)
+            render_intra_refresh(context);
     }
+    /* 0 lifts a cap sent for the previous picture */
+    if (max_frame_size || context->last_max_frame_size)
+        render_max_frame_size(context, max_frame_size, passes);
+    context->last_max_frame_size = max_frame_size;
+    if (context->input_num_roi[context->current_frame_display % SURFACE_NUM])
+        render_roi(context, context->current_frame_display % SURFACE_NUM);
+    if (context->input_qp_map[context->current_frame_display % SURFACE_NUM])
+        render_qp_map(context, context->current_frame_display % SURFACE_NUM);
     render_slice(context);
 
     va_status = vaEndPicture(context->va_dpy, context->context_id);
-    CHECK_VASTATUS_RETNULL(va_status,"vaEndPicture");
+    CHECK_VASTATUS(va_status,"vaEndPicture");
+
+    context->picture_pending = 1;
+    return VA_STATUS_SUCCESS;
+}
+
+/*
+ * Upload the frame and queue the next picture, if one is ready.  Sets
+ * picture_pending when something was submitted to the GPU.
+ */
+static VAStatus submit_picture(VA264Context * context, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int64_t pts, bool forceIDR)
+{
+    VAStatus va_status = queue_input(context, fourcc, y, u, v, pts, forceIDR);
+    if (va_status != VA_STATUS_SUCCESS)
+        return va_status;
+
+    return render_next_picture(context, 0);
+}
+
+/*
+ * Non-blocking completion check of the submitted picture.
+ */
+static int query_picture(VA264Context * context)
+{
+    VASurfaceStatus status;
+    VAStatus va_status;
 
-    va_status = vaSyncSurface(context->va_dpy, context->src_surface[context->current_frame_display % SURFACE_NUM]);
-    CHECK_VASTATUS_RETNULL(va_status,"vaSyncSurface");
+    va_status = vaQuerySurfaceStatus(context->va_dpy, context->src_surface[context->current_frame_display % SURFACE_NUM], &status);
+    if (va_status != VA_STATUS_SUCCESS)
+        return -1;
 
+    return (status & VASurfaceRendering) ? 0 : 1;
+}
+
+/*
+ * Wait for the submitted picture according to the context's sync mode.
+ * A negative timeout waits forever.  Returns VA_STATUS_ERROR_TIMEDOUT if
+ * the picture isn't ready in time.
+ */
+static VAStatus wait_picture(VA264Context * context, long long timeout_us)
+{
+    VASurfaceID surface = context->src_surface[context->current_frame_display % SURFACE_NUM];
+    double deadline = monotonic_seconds() + timeout_us / 1e6;
+    struct timespec interval;
+    int ready;
+
+    switch (context->sync_mode) {
+    case VA264_SYNC_BUFFER:
+#if VA_CHECK_VERSION(1, 9, 0)
+        return vaSyncBuffer(context->va_dpy, context->coded_buf[context->current_frame_display % SURFACE_NUM],
+                            timeout_us < 0 ? VA_TIMEOUT_INFINITE : (uint64_t)timeout_us * 1000);
+#endif
+        /* vaSyncBuffer needs libva 2.9, fall through to a blocking sync */
+
+    default:
+        if (timeout_us < 0)
+            return vaSyncSurface(context->va_dpy, surface);
+        /* vaSyncSurface can't time out, poll up to the deadline instead */
+        /* fall through */
+
+    case VA264_SYNC_POLL:
+        interval.tv_sec = context->poll_interval_us / 1000000;
+        interval.tv_nsec = (context->poll_interval_us % 1000000) * 1000;
+        while ((ready = query_picture(context)) == 0) {
+            if (timeout_us >= 0 && monotonic_seconds() >= deadline)
+                return VA_STATUS_ERROR_TIMEDOUT;
+            nanosleep(&interval, NULL);
+        }
+        return (ready < 0) ? VA_STATUS_ERROR_OPERATION_FAILED : VA_STATUS_SUCCESS;
+    }
+}
+
+static VAStatus finish_picture(VA264Context * context)
+{
+    VAStatus va_status = wait_picture(context, -1);
+    CHECK_VASTATUS(va_status,"wait_picture");
+
+    va_report_display_busy(context->va_dpy, monotonic_seconds() - context->submit_time);
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus encode_picture(VA264Context * context, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int64_t pts, bool forceIDR)
+{
+    VAStatus va_status = submit_picture(context, fourcc, y, u, v, pts, forceIDR);
+    if (va_status != VA_STATUS_SUCCESS || !context->picture_pending)
+        return va_status;
+
+    return finish_picture(context);
+}
+
+/*
+ * Return the offset of the next Annex B start code at or after 'from',
+ * including the leading zero byte of a 4 byte start code, or 'size' if none.
+ */
+static int find_start_code(const uint8_t * data, int size, int from)
+{
+    int i;
+
+    for (i = from; i + 2 < size; i++) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+            return (i > from && data[i - 1] == 0) ? i - 1 : i;
+    }
+    return size;
+}
+
+/*
+ * Hand one coded segment to the callback split into NAL units.  Bytes ahead
+ * of the first start code belong to a NAL unit that began in the previous
+ * segment and are delivered on their own.
+ */
+static int emit_nal_units(const uint8_t * data, int size, VA264OutputCallback callback, void * userdata)
+{
+    int start = find_start_code(data, size, 0);
+    int next, stop = 0;
+
+    if (start > 0)
+        stop = callback(userdata, data, start);
+
+    while (!stop && start < size) {
+        next = find_start_code(data, size, start + 3);
+        stop = callback(userdata, data + start, next - start);
+        start = next;
+    }
+    return stop;
+}
+
+/*
+ * Map a coded buffer and walk its segment list, calling back with each segment (or NAL unit) while it is mapped.
+ * Returns the total coded size, or -1 on failure.
+ */
+static int map_coded_buffer(VA264Context * context, VABufferID coded_buf, VA264FrameInfo * info,
+                            int output_mode, VA264OutputCallback callback, void * userdata)
+{
     VACodedBufferSegment *buf_list = NULL;
-    unsigned int coded_size = 0;
+    VAStatus va_status;
+    int coded_size = 0;
+    int stop = 0;
+
+    va_status = vaMapBuffer(context->va_dpy, coded_buf, (void **)(&buf_list));
+    if (va_status != VA_STATUS_SUCCESS) {
+        fprintf(stderr,"%s:%s (%d) failed,exit\n", __func__, "vaMapBuffer", __LINE__);
+        return -1;
+    }
 
-    va_status = vaMapBuffer(context->va_dpy, context->coded_buf[context->current_frame_display % SURFACE_NUM], (void **)(&buf_list));
-    CHECK_VASTATUS_RETNULL(va_status,"vaMapBuffer");
     while (buf_list != NULL) {
-        memcpy(&output[coded_size], buf_list->buf, buf_list->size);
+        if (!stop) {
+            if (output_mode == VA264_OUTPUT_NALS)
+                stop = emit_nal_units(buf_list->buf, buf_list->size, callback, userdata);
+            else
+                stop = callback(userdata, buf_list->buf, buf_list->size);
+        }
+        if (buf_list->status & VA_CODED_BUF_STATUS_FRAME_SIZE_OVERFLOW)
+            info->size_overflow = true;
         coded_size += buf_list->size;
         buf_list = (VACodedBufferSegment *) buf_list->next;
     }
-    *encodedsize = coded_size;
 
-    vaUnmapBuffer(context->va_dpy, context->coded_buf[context->current_frame_display % SURFACE_NUM]);
+    vaUnmapBuffer(context->va_dpy, coded_buf);
+    return coded_size;
+}
 
+/*
+ * Map a surface for reading, through a copy when the driver can't derive an
+ * image from it.  Returns NULL unless it is NV12.
+ */
+static uint8_t * map_surface(VA264Context * context, VASurfaceID surface, VAImage * image)
+{
+    VAImageFormat format = { .fourcc = VA_FOURCC_NV12, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 12 };
+    uint8_t * data = NULL;
+
+    if (vaDeriveImage(context->va_dpy, surface, image) != VA_STATUS_SUCCESS) {
+        if (vaCreateImage(context->va_dpy, &format, context->frame_width_mbaligned, context->frame_height_mbaligned, image) != VA_STATUS_SUCCESS)
+            return NULL;
+        if (vaGetImage(context->va_dpy, surface, 0, 0, context->frame_width_mbaligned, context->frame_height_mbaligned,
+                       image->image_id) != VA_STATUS_SUCCESS) {
+            vaDestroyImage(context->va_dpy, image->image_id);
+            return NULL;
+        }
+    }
+    if (image->format.fourcc != VA_FOURCC_NV12 || vaMapBuffer(context->va_dpy, image->buf, (void **)&data) != VA_STATUS_SUCCESS) {
+        vaDestroyImage(context->va_dpy, image->image_id);
+        return NULL;
+    }
+    return data;
+}
+
+static void unmap_surface(VA264Context * context, VAImage * image)
+{
+    vaUnmapBuffer(context->va_dpy, image->buf);
+    vaDestroyImage(context->va_dpy, image->image_id);
+}
+
+/*
+ * PSNR and SSIM of the reconstructed picture 'recon' against the source it
+ * was coded from, once the encode has finished.
+ */
+static void measure_quality(VA264Context * context, VASurfaceID source, VASurfaceID recon, VA264FrameInfo * info)
+{
+    int width = context->config.frame_width, height = context->config.frame_height;
+    int step = context->quality_step;
+    uint64_t sse_y, sse_uv, samples_y, samples_uv;
+    VAImage src_image, rec_image;
+    uint8_t * src, * rec;
+
+    src = map_surface(context, source, &src_image);
+    if (!src)
+        return;
+    rec = map_surface(context, recon, &rec_image);
+    if (!rec) {
+        unmap_surface(context, &src_image);
+        return;
+    }
+
+    if (context->quality_metrics & VA264_QUALITY_PSNR) {
+        /* the chroma plane is interleaved, rounded up to whole U and V pairs and rows */
+        int width_uv = (width + 1) & ~1, height_uv = (height + 1) / 2;
+
+        sse_y = qualitySSE(src + src_image.offsets[0], src_image.pitches[0], rec + rec_image.offsets[0], rec_image.pitches[0],
+                           width, height, step);
+        sse_uv = qualitySSE(src + src_image.offsets[1], src_image.pitches[1], rec + rec_image.offsets[1], rec_image.pitches[1],
+                            width_uv, height_uv, step);
+        samples_y = (uint64_t)width * ((height + step - 1) / step);
+        samples_uv = (uint64_t)width_uv * ((height_uv + step - 1) / step);
+        info->psnr_y = qualityPSNR(sse_y, samples_y);
+        info->psnr = qualityPSNR(sse_y + sse_uv, samples_y + samples_uv);
+    }
+    if (context->quality_metrics & VA264_QUALITY_SSIM)
+        info->ssim = qualitySSIM(src + src_image.offsets[0], src_image.pitches[0], rec + rec_image.offsets[0], rec_image.pitches[0],
+                                 width, height, step);
+
+    unmap_surface(context, &rec_image);
+    unmap_surface(context, &src_image);
+}
+
+/*
+ * Deliver the picture just encoded and move on to the next frame.
+ */
+static int output_coded_buffer(VA264Context * context, int output_mode, VA264OutputCallback callback, void * userdata)
+{
+    VABufferID coded_buf = context->coded_buf[context->current_frame_display % SURFACE_NUM];
+    int coded_size = map_coded_buffer(context, coded_buf, &context->frame_info, output_mode, callback, userdata);
+
+    if (context->quality_metrics && coded_size >= 0)
+        measure_quality(context, context->src_surface[context->current_frame_display % SURFACE_NUM],
+                        context->pic_param.CurrPic.picture_id, &context->frame_info);
+    if (context->soft_rc_mode && coded_size >= 0)
+        rateControlUpdate(&context->soft_rc, context->frame_info.frame_type, context->frame_info.qp, coded_size);
+
+    context->picture_pending = 0;
     update_ReferenceFrames(context);
+    return coded_size;
+}
+
+/*
+ * Returns the coded size, 0 if the frame was queued for reordering and
+ * nothing was coded yet, or -1 on failure.
+ */
+int encodeImageSegments(void * ctx, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int64_t pts, bool forceIDR,
+                        int output_mode, VA264OutputCallback callback, void * userdata)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    if (encode_picture(context, fourcc, y, u, v, pts, forceIDR) != VA_STATUS_SUCCESS)
+        return -1;
+    if (!context->picture_pending)
+        return 0;
+
+    return output_coded_buffer(context, output_mode, callback, userdata);
+}
+
+/*
+ * Code one of the frames still queued for reordering, at the end of a
+ * stream.  Call until it returns 0; the next input then starts a new GOP.
+ */
+int encodeFlush(void * ctx, int output_mode, VA264OutputCallback callback, void * userdata)
+{
+    VA264Context * context = (VA264Context *)ctx;
 
+    if (context->picture_pending)
+        return -1;
+    if (render_next_picture(context, 1) != VA_STATUS_SUCCESS)
+        return -1;
+    if (!context->picture_pending)
+        return 0;
+    if (finish_picture(context) != VA_STATUS_SUCCESS)
+        return -1;
+
+    return output_coded_buffer(context, output_mode, callback, userdata);
+}
+
+/*
+ * PTS, DTS and type of the picture last delivered (or in flight).
+ */
+void encodeFrameInfo(void * ctx, VA264FrameInfo * info)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    *info = context->frame_info;
+}
+
+/*
+ * Emit a skipped picture in place of the next frame without touching the
+ * GPU: a CAVLC PPS, a picture timing SEI when the HRD is in the VUI, then
+ * an all P_Skip, non-reference slice.  Only
+ * possible when the next frame would be a P frame in an IP-only GOP and we
+ * generate the SPS ourselves.  Returns the coded size, or -1 if the frame
+ * has to be encoded normally.
+ */
+int encodeSkipFrame(void * ctx, int64_t pts, VA264OutputCallback callback, void * userdata)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    unsigned long long display;
+    int frame_type;
+    unsigned char *pps = NULL, *sei = NULL, *slice = NULL, *output;
+    int pps_size, sei_size = 0, slice_size, size;
+
+    if (context->config.ip_period != 1 || context->frames_coded == 0 ||
+        context->frames_pending != 0 || context->idr_requested)
+        return -1;
+    if (!context->h264_packedheader ||
+        !(context->config_attrib[context->enc_packed_header_idx].value & VA_ENC_PACKED_HEADER_SEQUENCE))
+        return -1;
+
+    /* what the planner would make of the next frame, without content signals */
+    display = context->current_frame_input;
+    context->input_cut[display % SURFACE_NUM] = 0;
+    context->input_sad[display % SURFACE_NUM] = -1;
+    frame_type = plan_anchor_type(context, display, 1);
+    if (frame_type != FRAME_P)
+        return -1;
+
+    pps_size = (build_skip_pps_buffer(context, &pps) + 7) / 8;
+    if (hrd_in_vui(context))
+        sei_size = (build_skip_sei_buffer(context, display, &sei) + 7) / 8;
+    slice_size = (build_skip_slice_buffer(context, (display - context->poc_display) % MaxPicOrderCntLsb, &slice) + 7) / 8;
+
+    /* worst case one emulation prevention byte per two payload bytes */
+    output = malloc((pps_size + sei_size + slice_size) * 3 / 2 + 24);
+    assert(output);
+    size = escape_nal_unit(pps, pps_size, output);
+    if (sei)
+        size += escape_nal_unit(sei, sei_size, output + size);
+    size += escape_nal_unit(slice, slice_size, output + size);
+    free(pps);
+    free(sei);
+    free(slice);
+
+    callback(userdata, output, size);
+    free(output);
+
+    /* the skip takes the next frame's place, settings made for that frame go with it */
+    context->next_max_frame_size = 0;
+    context->next_num_roi = 0;
+    context->next_qp_map = 0;
+
+    /* a non-reference picture leaves frame_num and the reference list alone */
+    context->current_frame_display = display;
+    context->current_frame_type = FRAME_P;
     context->current_frame_encoding++;
-    return output;
+    context->current_frame_input++;
+    context->frames_coded++;
+    context->frame_info.pts = pts;
+    context->frame_info.dts = (pts > context->last_dts) ? pts : context->last_dts + 1;
+    context->frame_info.frame_type = FRAME_P;
+    context->frame_info.keyframe = false;
+    context->frame_info.size_overflow = false;
+    context->frame_info.qp = 0;
+    context->frame_info.frame_id = display;
+    context->frame_info.long_term = false;
+    /* nothing refers to it, so it can go with the top layer */
+    context->frame_info.temporal_id = context->temporal_layers ? context->temporal_layers - 1 : 0;
+    context->frame_info.psnr_y = context->frame_info.psnr = context->frame_info.ssim = 0;
+    context->last_dts = context->frame_info.dts;
+    return size;
+}
+
+/*
+ * The surface the next encode reads its input from.  Fill it on the GPU
+ * (e.g. with video processing) and pass a NULL frame to the encode call to
+ * skip the upload.
+ */
+VASurfaceID nextSourceSurface(void * ctx)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    return context->src_surface[context->current_frame_input % SURFACE_NUM];
+}
+
+/*
+ * Change the target (and, for VBR, peak) bitrate in bits per second without
+ * a keyframe.  Takes effect with the next picture submitted and may be
+ * called from any thread, including while an engine owns the context.  A
+ * max_bitrate of 0 keeps the peak equal to the target.
+ */
+void setBitrate(void * ctx, unsigned int bitrate, unsigned int max_bitrate)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    /* one store, so concurrent callers can't mix their target and peak */
+    __atomic_store_n(&context->next_bitrate, (uint64_t)bitrate << 32 | max_bitrate, __ATOMIC_RELAXED);
+    __atomic_store_n(&context->rc_update, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Change the frame rate the rate controller budgets for, e.g. when an
+ * adaptive screen capture slows down.  Like setBitrate it applies from the
+ * next picture and is safe to call from any thread.
+ */
+void setFrameRate(void * ctx, int frame_rate)
+{
+    setFrameRateFraction(ctx, frame_rate, 1);
+}
+
+/*
+ * Like setFrameRate for a rate of num/den frames per second, e.g.
+ * 30000/1001, which the stream timing then carries exactly.
+ */
+void setFrameRateFraction(void * ctx, int num, int den)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    if (num < 1 || den < 1)
+        return;
+    __atomic_store_n(&context->next_frame_rate, (uint64_t)num << 32 | (unsigned int)den, __ATOMIC_RELAXED);
+    __atomic_store_n(&context->fr_update, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Cap the coded size of every picture at max_frame_size bytes, 0 for no
+ * cap.  With passes > 1, and a driver that supports it, a picture over the
+ * cap is re-encoded up to that many times at a higher QP.  Ignored by
+ * drivers without VAConfigAttribEncMaxFrameSize.  Safe from any thread.
+ */
+void setMaxFrameSize(void * ctx, unsigned int max_frame_size, int passes)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    __atomic_store_n(&context->config.max_frame_passes, passes, __ATOMIC_RELAXED);
+    __atomic_store_n(&context->config.max_frame_size, max_frame_size, __ATOMIC_RELAXED);
+}
+
+/*
+ * Cap the next frame handed to an encode call at max_frame_size bytes,
+ * overriding setMaxFrameSize for that frame alone.  Call from the thread
+ * that encodes, or use engineSetNextFrameMaxSize with an engine.
+ */
+void setNextFrameMaxSize(void * ctx, unsigned int max_frame_size)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    context->next_max_frame_size = max_frame_size;
+}
+
+/*
+ * Regions of interest for the next frame handed to an encode call.  With
+ * qp_delta each value is added to the QP the picture would otherwise get
+ * (negative spends more bits); without it values are priorities the rate
+ * controller weighs (positive spends more bits).  Rectangles are in pixels
+ * and clipped to the frame.  Returns the number of regions kept, which the
+ * driver may limit, or -1 if it can't do ROI in this rate control mode.
+ * Call from the thread that encodes.
+ */
+int setNextFrameROI(void * ctx, const VA264ROI * rois, int num_rois, bool qp_delta)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    VAConfigAttribValEncROI caps;
+    int i, n = 0;
+
+    caps.value = context->roi_caps;
+    if (!caps.bits.num_roi_regions)
+        return -1;
+    if (context->config.rc_mode != VA_RC_CQP) {
+        /* in CQP mode every value is a QP delta */
+        if (qp_delta ? !caps.bits.roi_rc_qp_delta_support : !caps.bits.roi_rc_priority_support)
+            return -1;
+    } else if (!qp_delta) {
+        return -1;
+    }
+
+    for (i = 0; i < num_rois && n < (int)caps.bits.num_roi_regions && n < VA264_MAX_ROI; i++) {
+        int x0 = rois[i].x < 0 ? 0 : rois[i].x;
+        int y0 = rois[i].y < 0 ? 0 : rois[i].y;
+        int x1 = rois[i].x + rois[i].width;
+        int y1 = rois[i].y + rois[i].height;
+
+        if (x1 > context->config.frame_width)
+            x1 = context->config.frame_width;
+        if (y1 > context->config.frame_height)
+            y1 = context->config.frame_height;
+        if (x1 <= x0 || y1 <= y0)
+            continue;
+
+        context->next_roi[n].roi_rectangle.x = x0;
+        context->next_roi[n].roi_rectangle.y = y0;
+        context->next_roi[n].roi_rectangle.width = x1 - x0;
+        context->next_roi[n].roi_rectangle.height = y1 - y0;
+        context->next_roi[n].roi_value = rois[i].value < -51 ? -51 : (rois[i].value > 51 ? 51 : rois[i].value);
+        n++;
+    }
+    context->next_num_roi = n;
+    context->next_roi_qp_delta = qp_delta;
+    return n;
+}
+
+/*
+ * Per-macroblock QP deltas for the next frame handed to an encode call,
+ * width_in_mbs x height_in_mbs values 'stride' bytes apart.  Under CQP
+ * they are added to the QP the picture is coded with; under rate control
+ * the driver applies them as deltas.  Drivers with blocks larger than a
+ * macroblock get the lowest delta in each block.  The deltas are kept per
+ * surface slot and written into a pooled VA buffer when the picture is
+ * submitted.  Returns -1 if the driver can't take a QP map.  Call from the
+ * thread that encodes.
+ */
+int setNextFrameQPMap(void * ctx, const int8_t * map, int stride)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    unsigned int slot = context->current_frame_input % SURFACE_NUM;
+    int block = context->qp_block_size;
+    int width_in_mbs = context->frame_width_mbaligned / 16;
+    int height_in_mbs = context->frame_height_mbaligned / 16;
+    int width_in_blocks, height_in_blocks, mbs_per_block;
+    int x, y, i, j;
+
+    if (!block)
+        return -1;
+
+    width_in_blocks = (context->frame_width_mbaligned + block - 1) / block;
+    height_in_blocks = (context->frame_height_mbaligned + block - 1) / block;
+    mbs_per_block = block / 16;
+
+    if (!context->qp_delta[slot]) {
+        context->qp_delta[slot] = malloc(width_in_blocks * height_in_blocks);
+        if (!context->qp_delta[slot])
+            return -1;
+    }
+
+    for (y = 0; y < height_in_blocks; y++) {
+        for (x = 0; x < width_in_blocks; x++) {
+            int delta = 51;
+
+            for (j = y * mbs_per_block; j < (y + 1) * mbs_per_block && j < height_in_mbs; j++) {
+                for (i = x * mbs_per_block; i < (x + 1) * mbs_per_block && i < width_in_mbs; i++) {
+                    if (map[j * stride + i] < delta)
+                        delta = map[j * stride + i];
+                }
+            }
+            context->qp_delta[slot][y * width_in_blocks + x] = delta;
+        }
+    }
+
+    context->next_qp_map = 1;
+    return 0;
+}
+
+/*
+ * Watch the luma of every frame passed to an encode call for scene cuts
+ * and start a new GOP at each one: with VA264_SCENECUT_IDR the cut frame
+ * becomes an IDR, with VA264_SCENECUT_I an I frame.  The mini-GOP before
+ * the cut ends early, B frames never reference across it.  Frames filled in
+ * through nextSourceSurface are not analyzed.  Returns -1 if the detector
+ * can't be set up.  Call from the thread that encodes.
+ */
+int setSceneCutDetection(void * ctx, int mode)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    if (context->scene_cut_mode)
+        sceneCutDestroy(&context->scene_cut);
+    context->scene_cut_mode = VA264_SCENECUT_OFF;
+
+    if (mode == VA264_SCENECUT_OFF)
+        return 0;
+    if (sceneCutInit(&context->scene_cut, context->config.frame_width, context->config.frame_height) != 0)
+        return -1;
+    context->scene_cut_mode = mode;
+    return 0;
+}
+
+/*
+ * Let the GOP planner follow the content as well as the fixed periods:
+ * scene cuts start a new GOP, fast motion shortens the runs of B frames,
+ * and periodic I frames are skipped while nothing moves.  max_gop bounds
+ * the distance between IDR frames, 0 for ten seconds.  Turns on scene cut
+ * detection, which provides the signals, if it isn't on yet.  Call from
+ * the thread that encodes.
+ */
+int setAdaptiveGOP(void * ctx, bool enable, int max_gop)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    context->adaptive_gop = 0;
+    if (!enable)
+        return 0;
+    if (!context->scene_cut_mode && setSceneCutDetection(context, VA264_SCENECUT_IDR) != 0)
+        return -1;
+    context->max_gop = max_gop > 0 ? max_gop : context->config.frame_rate * 10;
+    context->adaptive_gop = 1;
+    return 0;
+}
+
+/*
+ * Refresh the picture a stripe of intra macroblocks at a time instead of
+ * coding periodic IDR and I frames, which spreads their cost over 'period'
+ * P frames, 0 for a second's worth.  Each sweep starts with a recovery point
+ * SEI and the parameter sets when the driver takes packed headers, so a
+ * decoder can join there.  Only IDR frames that are requested or follow a
+ * scene cut remain.  Needs ip_period 1 and no temporal layers; returns -1
+ * if the driver doesn't support the mode or the period is negative.  Call
+ * from the thread that encodes.
+ */
+int setIntraRefresh(void * ctx, int mode, int period)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    context->intra_refresh_mode = VA264_REFRESH_OFF;
+    context->intra_refresh_pos = 0;
+    if (mode == VA264_REFRESH_OFF)
+        return 0;
+
+    if (period == 0)
+        period = context->config.frame_rate > 0 ? context->config.frame_rate : VA264_DEFAULT_FRAME_RATE;
+    if (period <= 0 || !intra_refresh_supported(context, mode))
+        return -1;
+
+    context->intra_refresh_period = period;
+    context->intra_refresh_mode = mode;
+    return 0;
+}
+
+/*
+ * Keep up to 'count' long-term references (VA264_MAX_LTR at most, 0 to
+ * stop), a new one every 'interval' frames in addition to every IDR and
+ * recovery picture.  The reconstructions get surfaces of their own, so the
+ * context is set up again and the next picture is an IDR.  Needs ip_period
+ * 1, no temporal layers and packed slice headers, which carry the reference
+ * marking; returns -1 otherwise, or with frames still queued.  Call from the thread that
+ * encodes.
+ */
+int setLongTermReferences(void * ctx, int count, int interval)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    int packed = context->h264_packedheader ? context->config_attrib[context->enc_packed_header_idx].value : 0;
+    int i;
+
+    if (count < 0 || count > VA264_MAX_LTR || context->picture_pending || context->frames_pending)
+        return -1;
+    if (count && (context->config.ip_period != 1 || context->temporal_layers ||
+                  !(packed & VA_ENC_PACKED_HEADER_SEQUENCE) || !(packed & VA_ENC_PACKED_HEADER_SLICE)))
+        return -1;
+
+    /* the surfaces are render targets of the encode context */
+    if (!count != !context->ltr_count) {
+        release_context(context);
+        if (context->ltr_surfaces) {
+            vaDestroySurfaces(context->va_dpy, &context->ltr_surface[0], VA264_LTR_SURFACES);
+            context->ltr_surfaces = 0;
+        }
+        context->ltr_count = count;
+        if (count && vaCreateSurfaces(context->va_dpy, VA_RT_FORMAT_YUV420,
+                                      context->frame_width_mbaligned, context->frame_height_mbaligned,
+                                      &context->ltr_surface[0], VA264_LTR_SURFACES, NULL, 0) == VA_STATUS_SUCCESS)
+            context->ltr_surfaces = 1;
+        if (setup_context(context) != VA_STATUS_SUCCESS || (count && !context->ltr_surfaces)) {
+            context->ltr_count = 0;
+            return -1;
+        }
+    }
+
+    context->ltr_count = count;
+    context->ltr_interval = interval > 0 ? interval : 0;
+    for (i = 0; i < VA264_MAX_LTR; i++) {
+        context->ltr_pic[i].picture_id = VA_INVALID_SURFACE;
+        context->ltr_pic[i].flags = VA_PICTURE_H264_INVALID;
+    }
+    context->ltr_candidate = -1;
+    context->ltr_recover_slot = -1;
+    context->ltr_recovering = -1;
+    context->ltr_num_mmco = 0;
+    if (context->frames_coded)
+        context->idr_requested = 1;
+    return 0;
+}
+
+/*
+ * The receiver lost the frame with VA264FrameInfo.frame_id 'lost_frame_id'.
+ * The next picture refers only to the long-term reference 'ref_frame_id',
+ * or to the newest one the receiver is known to have when that is -1 or
+ * isn't usable, and leaves itself as the only reference, like an IDR but
+ * at the cost of a P frame.  Without a usable long-term reference the next
+ * picture is an IDR.  Call from the thread that encodes.
+ */
+int reportFrameLoss(void * ctx, unsigned long long lost_frame_id, long long ref_frame_id)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    int i, best = -1;
+
+    if (context->frames_coded == 0 || lost_frame_id < context->current_IDR_display)
+        return VA264_RECOVER_NONE;
+    /* unless the recovery since relied on the lost frame, reported late */
+    if (lost_frame_id < context->ltr_clean_display && (long long)lost_frame_id > context->ltr_clean_ref)
+        return VA264_RECOVER_NONE;
+
+    /* a long-term reference is good if the picture that marked it arrived */
+    for (i = 0; i < context->ltr_count; i++) {
+        if ((context->ltr_pic[i].flags & VA_PICTURE_H264_INVALID) || context->ltr_marked[i] >= lost_frame_id)
+            continue;
+        if (ref_frame_id >= 0 && context->ltr_display[i] == (unsigned long long)ref_frame_id) {
+            best = i;
+            break;
+        }
+        if (best < 0 || context->ltr_display[i] > context->ltr_display[best])
+            best = i;
+    }
+
+    /*
+     * A recovery already on its way answers an earlier loss.  Keep its slot
+     * when it is the older one: it was marked before both losses, while the
+     * newer pick may have been marked after the earlier loss by a picture
+     * the receiver couldn't decode.
+     */
+    if (context->ltr_recover_slot >= 0 && best >= 0 &&
+        context->ltr_display[context->ltr_recover_slot] < context->ltr_display[best])
+        best = context->ltr_recover_slot;
+
+    if (best < 0) {
+        context->ltr_recover_slot = -1;
+        context->idr_requested = 1;
+        return VA264_RECOVER_IDR;
+    }
+    context->ltr_recover_slot = best;
+    return VA264_RECOVER_LTR;
+}
+
+/*
+ * Code 'layers' temporal layers (VA264_MAX_TEMPORAL_LAYERS at most, 1 or 0
+ * to stop): L1T2 halves the frame rate of the base layer, L1T3 quarters it
+ * with a middle layer at half.  The top layer is coded as non-reference
+ * pictures, and no picture refers to a higher layer than its own, so an SFU
+ * can drop layers from the top by VA264FrameInfo.temporal_id without
+ * touching the rest.  The next picture is an IDR.  Needs ip_period 1, no
+ * intra refresh or long-term references, and packed slice headers, which
+ * carry the reference list modification; returns -1 otherwise.  Call from
+ * the thread that encodes.
+ */
+int setTemporalLayers(void * ctx, int layers)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    int packed = context->h264_packedheader ? context->config_attrib[context->enc_packed_header_idx].value : 0;
+
+    if (layers < 0 || layers > VA264_MAX_TEMPORAL_LAYERS)
+        return -1;
+    if (layers <= 1) {
+        context->temporal_layers = 0;
+        return 0;
+    }
+    if (context->config.ip_period != 1 || context->intra_refresh_mode || context->ltr_count ||
+        !(packed & VA_ENC_PACKED_HEADER_SEQUENCE) || !(packed & VA_ENC_PACKED_HEADER_SLICE))
+        return -1;
+
+    /* the SPS allows frame_num gaps for L1T3 */
+    if (context->frames_coded && layers != context->temporal_layers)
+        context->idr_requested = 1;
+    context->temporal_layers = layers;
+    context->temporal_pos = 0;
+    return 0;
+}
+
+/*
+ * How keyframe requests from receivers are served.  Requests within
+ * 'window_ms' after a keyframe are taken to be served by it, and a
+ * requested keyframe follows the previous keyframe by 'min_interval_ms' at
+ * least.  'mode' VA264_KEYFRAME_I codes an I frame with a recovery point
+ * SEI instead of an IDR, which needs packed SEI and slice headers; returns
+ * -1 without them.  IDR frames are still coded while long-term references
+ * are on.  Call from the thread that encodes.
+ */
+int setKeyFrameRequests(void * ctx, int mode, int window_ms, int min_interval_ms)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    int packed = context->h264_packedheader ? context->config_attrib[context->enc_packed_header_idx].value : 0;
+
+    if (mode == VA264_KEYFRAME_I && (!packed_sei(context) || !(packed & VA_ENC_PACKED_HEADER_SLICE)))
+        return -1;
+    context->keyframe_mode = mode;
+    context->keyframe_window = window_ms > 0 ? window_ms / 1000.0 : 0;
+    context->keyframe_min_interval = min_interval_ms > 0 ? min_interval_ms / 1000.0 : 0;
+    return 0;
+}
+
+/*
+ * Ask for a keyframe, e.g. on a PLI or FIR from a receiver.  Requests are
+ * coalesced as set with setKeyFrameRequests, and the keyframe is coded at
+ * the next anchor picture without restarting the GOP layout.  Safe to call
+ * from any thread.
+ */
+void requestKeyFrame(void * ctx)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    __atomic_add_fetch(&context->keyframe_requests, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Measure the reconstruction of every picture against its uploaded source:
+ * VA264_QUALITY_PSNR for luma and overall PSNR, VA264_QUALITY_SSIM for luma
+ * SSIM, into VA264FrameInfo.  Both surfaces are read back from the GPU once
+ * the encode has finished, which takes time, so 'step' > 1 only looks at
+ * every step-th row and SSIM window in each direction.  Batch encodes leave
+ * the long-term reference candidates out.  Call from the thread that
+ * encodes.
+ */
+void setQualityMetrics(void * ctx, int metrics, int step)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    context->quality_metrics = metrics & (VA264_QUALITY_PSNR | VA264_QUALITY_SSIM);
+    context->quality_step = step > 1 ? step : 1;
+}
+
+/*
+ * HRD buffer size and initial fullness in bits, 0 to leave the buffer model
+ * to the driver.  With in_vui the SPS also signals the HRD, and buffering
+ * period and picture timing SEI are sent, when the driver takes packed SEI.
+ * Sequence level, so a running stream switches at the next anchor picture,
+ * which becomes an IDR.  Call from the thread that encodes.
+ */
+void setHRD(void * ctx, unsigned int buffer_size, unsigned int initial_fullness, bool in_vui)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    context->config.hrd_buffer_size = buffer_size;
+    context->config.hrd_initial_fullness = (initial_fullness && initial_fullness <= buffer_size) ? initial_fullness : buffer_size / 2;
+    context->config.hrd_in_vui = in_vui;
+    if (context->soft_rc_mode)
+        setup_soft_rc(context);
+    if (context->frames_coded)
+        context->idr_requested = 1;
+}
+
+void setSyncMode(void * ctx, int sync_mode, int poll_interval_us)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    context->sync_mode = sync_mode;
+    context->poll_interval_us = (poll_interval_us > 0) ? poll_interval_us : 200;
+}
+
+/*
+ * Asynchronous encode: encodeSubmit queues one frame and returns at once,
+ * encodeQuery reports whether it is done (1), still running (0) or failed
+ * (-1), waiting up to timeout_us, and encodeCollect delivers the coded data
+ * like encodeImageSegments.  Only one frame per context can be in flight.
+ * While B frame reordering holds the frame back nothing is queued on the
+ * GPU and encodeQuery/encodeCollect return -1.
+ */
+int encodeSubmit(void * ctx, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int64_t pts, bool forceIDR)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    if (context->picture_pending)
+        return -1;
+
+    if (submit_picture(context, fourcc, y, u, v, pts, forceIDR) != VA_STATUS_SUCCESS)
+        return -1;
+
+    /* let the completion poller watch this picture, if one was queued */
+    if (context->picture_pending)
+        __atomic_store_n(&context->notify_armed,
+                         NOTIFY_ARMED | context->src_surface[context->current_frame_display % SURFACE_NUM],
+                         __ATOMIC_RELEASE);
+    return 0;
+}
+
+int encodeQuery(void * ctx, int timeout_us)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    VAStatus va_status;
+
+    if (!context->picture_pending)
+        return -1;
+
+    if (timeout_us == 0)
+        return query_picture(context);
+
+    va_status = wait_picture(context, timeout_us);
+    if (va_status == VA_STATUS_ERROR_TIMEDOUT)
+        return 0;
+    return (va_status == VA_STATUS_SUCCESS) ? 1 : -1;
+}
+
+int encodeCollect(void * ctx, int output_mode, VA264OutputCallback callback, void * userdata)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    if (!context->picture_pending)
+        return -1;
+
+    __atomic_store_n(&context->notify_armed, 0, __ATOMIC_RELEASE);
+    if (finish_picture(context) != VA_STATUS_SUCCESS)
+        return -1;
+
+    return output_coded_buffer(context, output_mode, callback, userdata);
+}
+
+typedef struct {
+    uint8_t *   output;
+    int         size;
+} coded_copy;
+
+static int copy_coded_segment(void * userdata, const uint8_t * data, int size)
+{
+    coded_copy * copy = (coded_copy *)userdata;
+
+    memcpy(&copy->output[copy->size], data, size);
+    copy->size += size;
+    return 0;
+}
+
+/*
+ * With B frames the coded frame returned belongs to an earlier input, see
+ * info; *encodedsize is 0 while the first frames are queued for reordering.
+ */
+uint8_t * encodeImageTimed(void * ctx, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int64_t pts,
+                           int * encodedsize, bool forceIDR, VA264FrameInfo * info)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    coded_copy copy = { context->encoded_buffer, 0 };
+
+    if (encodeImageSegments(ctx, fourcc, y, u, v, pts, forceIDR, VA264_OUTPUT_SEGMENTS, copy_coded_segment, &copy) < 0)
+        return NULL;
+
+    if (info)
+        *info = context->frame_info;
+    *encodedsize = copy.size;
+    return copy.output;
+}
+
+uint8_t * encodeImage(void * ctx, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int * encodedsize, bool forceIDR)
+{
+    VA264Context * context = (VA264Context *)ctx;
+
+    return encodeImageTimed(ctx, fourcc, y, u, v, context->current_frame_input, encodedsize, forceIDR, NULL);
+}
+
+/*
+ * Batch encode.  Up to BATCH_WINDOW frames are kept in flight: the next
+ * frame is uploaded and queued while the GPU is still encoding the previous
+ * ones, and the coded buffers are collected in order behind them.  The
+ * reference list only depends on the frame types, so it can be advanced at
+ * submit time.
+ */
+#define BATCH_WINDOW 4
+
+typedef struct {
+    VASurfaceID     surface;
+    VASurfaceID     recon;
+    VABufferID      coded_buf;
+    double          submit_time;
+    VA264FrameInfo  info;
+} batch_slot;
+
+typedef struct {
+    VA264Context *  context;
+    int             size;
+} batch_copy;
+
+static int copy_batch_segment(void * userdata, const uint8_t * data, int size)
+{
+    batch_copy * copy = (batch_copy *)userdata;
+    VA264Context * context = copy->context;
+
+    if (copy->size + size > context->batch_buffer_size) {
+        int grown = (copy->size + size) * 2;
+        uint8_t * buffer = realloc(context->batch_buffer, grown);
+        if (!buffer)
+            return 1;
+        context->batch_buffer = buffer;
+        context->batch_buffer_size = grown;
+    }
+
+    memcpy(&context->batch_buffer[copy->size], data, size);
+    copy->size += size;
+    return 0;
+}
+
+/*
+ * Encode num_frames frames in one call.  outputs[] receives the coded
+ * frames in coding order, stored back to back in a buffer owned by the
+ * context and valid until the next encodeImages call; with B frames fewer
+ * frames than were passed in may come out, the rest follow with the next
+ * batch or encodeFlush.  Returns the number of coded frames, stopping at
+ * the first failure.
+ */
+int encodeImages(void * ctx, const VA264Frame * frames, int num_frames, VA264CodedFrame * outputs)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    batch_slot slots[BATCH_WINDOW];
+    batch_copy copy = { context, 0 };
+    double now, reported = 0;
+    int queued = 0, submitted = 0, collected = 0, encoded = 0, failed = 0;
+    int i, start, ok;
+
+    if (context->picture_pending)
+        return -1;
+
+    while (collected < submitted || (!failed && queued < num_frames)) {
+        const VA264Frame * frame = &frames[queued];
+
+        if (!failed && queued < num_frames && submitted - collected < BATCH_WINDOW) {
+            batch_slot * slot = &slots[submitted % BATCH_WINDOW];
+
+            context->next_max_frame_size = frame->max_frame_size;
+            if (!frame->y || submit_picture(context, frame->fourcc, frame->y, frame->u, frame->v, frame->pts, frame->forceIDR) != VA_STATUS_SUCCESS) {
+                failed = 1;
+                continue;
+            }
+            queued++;
+            if (!context->picture_pending)
+                continue;
+
+            slot->surface = context->src_surface[context->current_frame_display % SURFACE_NUM];
+            slot->recon = context->pic_param.CurrPic.picture_id;
+            slot->coded_buf = context->coded_buf[context->current_frame_display % SURFACE_NUM];
+            slot->submit_time = context->submit_time;
+            slot->info = context->frame_info;
+
+            context->picture_pending = 0;
+            update_ReferenceFrames(context);
+            submitted++;
+            continue;
+        }
+
+        batch_slot * slot = &slots[collected % BATCH_WINDOW];
+
+        start = copy.size;
+        ok = vaSyncSurface(context->va_dpy, slot->surface) == VA_STATUS_SUCCESS &&
+             map_coded_buffer(context, slot->coded_buf, &slot->info, VA264_OUTPUT_SEGMENTS, copy_batch_segment, &copy) >= 0;
+
+        /* the pictures overlap on the GPU, count each stretch of wall time once */
+        now = monotonic_seconds();
+        va_report_display_busy(context->va_dpy, now - (slot->submit_time > reported ? slot->submit_time : reported));
+        reported = now;
+
+        /* a long-term surface may have been coded into again by the pictures since */
+        if (ok && context->quality_metrics && !slot->info.long_term)
+            measure_quality(context, slot->surface, slot->recon, &slot->info);
+
+        /* only report the frames ahead of the first failure */
+        if (ok && context->soft_rc_mode)
+            rateControlUpdate(&context->soft_rc, slot->info.frame_type, slot->info.qp, copy.size - start);
+
+        if (ok && encoded == collected) {
+            outputs[collected].size = copy.size - start;
+            outputs[collected].info = slot->info;
+            encoded++;
+        } else {
+            failed = 1;
+        }
+        collected++;
+    }
+
+    /* the buffer may have moved while it grew */
+    for (i = 0, start = 0; i < encoded; i++) {
+        outputs[i].data = context->batch_buffer + start;
+        start += outputs[i].size;
+    }
+
+    return encoded;
 }
 
 #ifdef MAKE_MAIN
@@ -1616,8 +4126,9 @@ int main(int argc,char **argv)
     //   |0            |ignored          |1         | IDRPPPPPPP ...     (No IDR/I any more)
     //
     // When intra_period and intra_idr_period are equal, all intra frames will be emitted as IDR frames
-    // We will then specify forceIDR=true for every 100th frame.  This in effect resets the internal frame type tracking so it starts 
-    // at frame '0' again.  This will in effect force an IDR frame regardless of which ever GOP structure you are using.
+    // We will then specify forceIDR=true for every 100th frame.  The next anchor picture becomes an IDR regardless of which
+    // ever GOP structure you are using; the periods carry on from it.  Receivers asking for keyframes should go through
+    // requestKeyFrame instead, which coalesces their requests.
     int intra_period = 60;
     int intra_idr_period = 60;
     int ip_period = 1;
@@ -1628,7 +4139,10 @@ int main(int argc,char **argv)
     }
 
     int idr_every = 100;
+    setQualityMetrics(context, VA264_QUALITY_PSNR | VA264_QUALITY_SSIM, 1);
     FILE* fout = fopen("/tmp/test.264","w+");
+    // per-frame type, QP and size for the rate control simulator, see h264rcsim.c
+    FILE* ftrace = fopen("/tmp/test.trace","w+");
     unsigned int encsize = 0;
 
     uint8_t * y = (uint8_t *)malloc(640 * 480);
@@ -1646,12 +4160,15 @@ int main(int argc,char **argv)
         bool forceIDR = !(i % idr_every);
         uint8_t * output = encodeImage(context, VA_FOURCC_NV12, y, u, v, &encsize, forceIDR);
 
-        // output the frame number, it's frame type and encoded size
-        printf("encoding frame %d %s %d\n", i, frametype_to_string(context->current_frame_type), encsize);
+        // output the frame number, it's frame type, encoded size and quality
+        printf("encoding frame %d %s %d psnr %.2f ssim %.4f\n", i, frametype_to_string(context->current_frame_type), encsize,
+               context->frame_info.psnr, context->frame_info.ssim);
 
         if(encsize != 0 && output)
         {
             fwrite(output, encsize, 1, fout);
+            fprintf(ftrace, "%s %d %d\n", frametype_to_string(context->current_frame_type),
+                    context->frame_info.qp ? context->frame_info.qp : context->config.initial_qp, encsize);
         }
         else
         {
@@ -1660,6 +4177,30 @@ int main(int argc,char **argv)
     }
 
     fclose(fout);
+    fclose(ftrace);
+
+    // With intra refresh on, the sweeps replace the periodic I and IDR frames: the only intra
+    // pictures left are the keyframes asked for with requestKeyFrame.
+    if (setIntraRefresh(context, VA264_REFRESH_COLUMN, 30) == 0) {
+        for(int i = 0; i < 300; i++)
+        {
+            bool requested = (i % 90 == 45);
+
+            yuvgen_planar(640, 480, y, 640, u, 640, v, 640, VA_FOURCC_NV12, 8, i, 0);
+            if (requested)
+                requestKeyFrame(context);
+            uint8_t * output = encodeImage(context, VA_FOURCC_NV12, y, u, v, &encsize, false);
+            if(encsize == 0 || !output)
+                break;
+
+            bool intra = (context->current_frame_type == FRAME_I || context->current_frame_type == FRAME_IDR);
+            if (intra != requested) {
+                fprintf(stderr, "intra refresh: frame %d is %s, keyframe %srequested\n", i,
+                        frametype_to_string(context->current_frame_type), requested ? "" : "not ");
+                exit(1);
+            }
+        }
+    }
 
     release_encode(context);
     deinit_va(context);
@@ -0,0 +1,427 @@
+/*
+ * Threaded encode engine.
+ *
+ * A worker thread owns the VA264Context and is fed through a lock-free
+ * single-producer/single-consumer ring of raw frames.  Coded frames come back
+ * through a second SPSC ring, so the caller can submit and poll without ever
+ * waiting on the GPU.  The semaphores are only used to park a side that has
+ * nothing to do; the rings themselves are plain atomic head/tail counters.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+
+#include "va_h264.h"
+
+typedef struct {
+    int                 fourcc;
+    bool                forceIDR;
+    uint8_t *           y;
+    uint8_t *           u;
+    uint8_t *           v;
+    int64_t             pts;
+    unsigned int        max_frame_size;
+} engine_frame;
+
+typedef struct {
+    uint8_t *           data;
+    int                 size;
+    VA264FrameInfo      info;
+} engine_packet;
+
+typedef struct {
+    VA264Context *      context;
+    pthread_t           thread;
+    atomic_int          running;
+
+    unsigned int        depth;
+    int                 frame_size;
+    int                 packet_size;
+
+    /* input ring: the caller produces, the worker consumes */
+    engine_frame *      frames;
+    atomic_uint         frame_head;
+    atomic_uint         frame_tail;
+    sem_t               frame_ready;
+
+    /* output ring: the worker produces, the caller consumes */
+    engine_packet *     packets;
+    atomic_uint         packet_head;
+    atomic_uint         packet_tail;
+    sem_t               packet_ready;
+    sem_t               packet_space;
+
+    /* overload handling, see engineSetOverloadPolicy */
+    atomic_int          overload_policy;
+    atomic_uint         overload_threshold;
+    int                 decimating;
+    unsigned int        decimate_phase;
+    int                 full_rate_num;
+    int                 full_rate_den;
+    bool                pending_idr;
+    unsigned int        next_max_frame_size;    /* producer side, see engineSetNextFrameMaxSize */
+
+    atomic_ullong       submitted;
+    atomic_ullong       encoded;
+    atomic_ullong       dropped;
+    atomic_ullong       skipped;
+    atomic_ullong       rejected;
+    atomic_uint         max_queue_depth;
+} VA264Engine;
+
+static int copy_to_packet(void * userdata, const uint8_t * data, int size)
+{
+    engine_packet * packet = (engine_packet *)userdata;
+
+    memcpy(&packet->data[packet->size], data, size);
+    packet->size += size;
+    return 0;
+}
+
+#define ENGINE_ENCODE   0
+#define ENGINE_DROP     1
+#define ENGINE_SKIP     2
+
+/*
+ * Decide what to do with the oldest queued frame given how many frames are
+ * waiting behind it.  Dropping and skipping only ever happen on the worker
+ * side, which owns the read end of the ring.
+ */
+static int overload_action(VA264Engine * engine, unsigned int queued)
+{
+    int policy = atomic_load_explicit(&engine->overload_policy, memory_order_relaxed);
+    unsigned int threshold = atomic_load_explicit(&engine->overload_threshold, memory_order_relaxed);
+
+    if (policy == VA264_OVERLOAD_NONE)
+        return ENGINE_ENCODE;
+
+    if (policy == VA264_OVERLOAD_REDUCE_FRAMERATE) {
+        /* halve the frame rate from the moment we fall behind until the queue has drained */
+        if (queued > threshold && !engine->decimating) {
+            engine->decimating = 1;
+            engine->decimate_phase = 0;
+            /* let the rate controller spend the dropped frames' bits on the ones we keep */
+            engine->full_rate_num = engine->context->config.frame_rate_num;
+            engine->full_rate_den = engine->context->config.frame_rate_den;
+            setFrameRateFraction(engine->context, engine->full_rate_num, engine->full_rate_den * 2);
+        } else if (queued <= 1 && engine->decimating) {
+            engine->decimating = 0;
+            setFrameRateFraction(engine->context, engine->full_rate_num, engine->full_rate_den);
+        }
+        if (engine->decimating)
+            return (engine->decimate_phase++ & 1) ? ENGINE_DROP : ENGINE_ENCODE;
+        return ENGINE_ENCODE;
+    }
+
+    if (queued <= threshold)
+        return ENGINE_ENCODE;
+
+    return (policy == VA264_OVERLOAD_SKIP) ? ENGINE_SKIP : ENGINE_DROP;
+}
+
+static void * engine_worker(void * arg)
+{
+    VA264Engine * engine = (VA264Engine *)arg;
+
+    while (1) {
+        sem_wait(&engine->frame_ready);
+        if (!atomic_load_explicit(&engine->running, memory_order_acquire))
+            break;
+
+        unsigned int tail = atomic_load_explicit(&engine->frame_tail, memory_order_relaxed);
+        unsigned int queued = atomic_load_explicit(&engine->frame_head, memory_order_acquire) - tail;
+        engine_frame * frame = &engine->frames[tail % engine->depth];
+        int action = overload_action(engine, queued);
+
+        if (queued > atomic_load_explicit(&engine->max_queue_depth, memory_order_relaxed))
+            atomic_store_explicit(&engine->max_queue_depth, queued, memory_order_relaxed);
+
+        if (action == ENGINE_DROP) {
+            /* a keyframe request must survive the frame it arrived with */
+            engine->pending_idr |= frame->forceIDR;
+            atomic_fetch_add_explicit(&engine->dropped, 1, memory_order_relaxed);
+            atomic_store_explicit(&engine->frame_tail, tail + 1, memory_order_release);
+            continue;
+        }
+
+        /* wait for the caller to hand back a packet slot */
+        sem_wait(&engine->packet_space);
+        if (!atomic_load_explicit(&engine->running, memory_order_acquire))
+            break;
+
+        unsigned int head = atomic_load_explicit(&engine->packet_head, memory_order_relaxed);
+        engine_packet * packet = &engine->packets[head % engine->depth];
+        bool forceIDR = frame->forceIDR || engine->pending_idr;
+
+        bool skipped = false;
+
+        packet->size = 0;
+        setNextFrameMaxSize(engine->context, frame->max_frame_size);
+        if (action == ENGINE_SKIP && !forceIDR &&
+            encodeSkipFrame(engine->context, frame->pts, copy_to_packet, packet) >= 0) {
+            skipped = true;
+        } else {
+            if (encodeImageSegments(engine->context, frame->fourcc, frame->y, frame->u, frame->v, frame->pts, forceIDR,
+                                    VA264_OUTPUT_SEGMENTS, copy_to_packet, packet) < 0)
+                packet->size = -1;
+            engine->pending_idr = false;
+        }
+        encodeFrameInfo(engine->context, &packet->info);
+
+        /* the frame has been uploaded and encoded, give the slot back */
+        atomic_store_explicit(&engine->frame_tail, tail + 1, memory_order_release);
+
+        atomic_store_explicit(&engine->packet_head, head + 1, memory_order_release);
+        sem_post(&engine->packet_ready);
+
+        /* only count the frame once its packet can be received */
+        atomic_fetch_add_explicit(skipped ? &engine->skipped : &engine->encoded, 1, memory_order_relaxed);
+    }
+
+    return NULL;
+}
+
+/*
+ * Size of the chroma planes handed to upload_surface_yuv: NV12 carries
+ * interleaved UV in 'u', I420/YV12 carry two quarter size planes.
+ */
+static void chroma_plane_sizes(int fourcc, int width, int height, int * u_size, int * v_size)
+{
+    if (fourcc == VA_FOURCC_NV12) {
+        *u_size = width * (height / 2);
+        *v_size = 0;
+    } else {
+        *u_size = *v_size = (width / 2) * (height / 2);
+    }
+}
+
+void * createEngine(void * ctx, int queue_depth)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    VA264Engine * engine;
+    unsigned int i;
+
+    if (!context || queue_depth < 1)
+        return NULL;
+
+    engine = (VA264Engine *)calloc(1, sizeof(VA264Engine));
+    if (!engine)
+        return NULL;
+
+    engine->context = context;
+    context->engine_attached = 1;
+    engine->depth = queue_depth;
+    engine->frame_size = context->config.frame_width * context->config.frame_height * 3 / 2;
+    engine->packet_size = context->frame_width_mbaligned * context->frame_height_mbaligned * 3;
+    engine->frames = (engine_frame *)calloc(engine->depth, sizeof(engine_frame));
+    engine->packets = (engine_packet *)calloc(engine->depth, sizeof(engine_packet));
+    if (!engine->frames || !engine->packets)
+        goto fail;
+
+    for (i = 0; i < engine->depth; i++) {
+        engine->frames[i].y = (uint8_t *)malloc(engine->frame_size);
+        engine->packets[i].data = (uint8_t *)malloc(engine->packet_size);
+        if (!engine->frames[i].y || !engine->packets[i].data)
+            goto fail;
+    }
+
+    atomic_init(&engine->running, 1);
+    atomic_init(&engine->frame_head, 0);
+    atomic_init(&engine->frame_tail, 0);
+    atomic_init(&engine->packet_head, 0);
+    atomic_init(&engine->packet_tail, 0);
+    atomic_init(&engine->overload_policy, VA264_OVERLOAD_NONE);
+    atomic_init(&engine->overload_threshold, engine->depth);
+    atomic_init(&engine->submitted, 0);
+    atomic_init(&engine->encoded, 0);
+    atomic_init(&engine->dropped, 0);
+    atomic_init(&engine->skipped, 0);
+    atomic_init(&engine->rejected, 0);
+    atomic_init(&engine->max_queue_depth, 0);
+    sem_init(&engine->frame_ready, 0, 0);
+    sem_init(&engine->packet_ready, 0, 0);
+    sem_init(&engine->packet_space, 0, engine->depth);
+
+    if (pthread_create(&engine->thread, NULL, engine_worker, engine) != 0) {
+        fprintf(stderr, "error: failed to start the encode thread\n");
+        sem_destroy(&engine->frame_ready);
+        sem_destroy(&engine->packet_ready);
+        sem_destroy(&engine->packet_space);
+        goto fail;
+    }
+
+    return engine;
+
+fail:
+    context->engine_attached = 0;
+    if (engine->frames) {
+        for (i = 0; i < engine->depth; i++)
+            free(engine->frames[i].y);
+    }
+    if (engine->packets) {
+        for (i = 0; i < engine->depth; i++)
+            free(engine->packets[i].data);
+    }
+    free(engine->frames);
+    free(engine->packets);
+    free(engine);
+    return NULL;
+}
+
+void destroyEngine(void * eng)
+{
+    VA264Engine * engine = (VA264Engine *)eng;
+    unsigned int i;
+
+    atomic_store_explicit(&engine->running, 0, memory_order_release);
+    sem_post(&engine->frame_ready);
+    sem_post(&engine->packet_space);
+    pthread_join(engine->thread, NULL);
+
+    destroyContext(engine->context);
+
+    for (i = 0; i < engine->depth; i++) {
+        free(engine->frames[i].y);
+        free(engine->packets[i].data);
+    }
+    free(engine->frames);
+    free(engine->packets);
+    sem_destroy(&engine->frame_ready);
+    sem_destroy(&engine->packet_ready);
+    sem_destroy(&engine->packet_space);
+    free(engine);
+}
+
+int engineSubmit(void * eng, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int64_t pts, bool forceIDR)
+{
+    VA264Engine * engine = (VA264Engine *)eng;
+    int width = engine->context->config.frame_width;
+    int height = engine->context->config.frame_height;
+    int u_size, v_size;
+
+    unsigned int head = atomic_load_explicit(&engine->frame_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&engine->frame_tail, memory_order_acquire);
+    if (head - tail >= engine->depth) {
+        /* overflowing the ring drops the new frame whatever the policy */
+        atomic_fetch_add_explicit(&engine->rejected, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    engine_frame * frame = &engine->frames[head % engine->depth];
+    chroma_plane_sizes(fourcc, width, height, &u_size, &v_size);
+
+    frame->fourcc = fourcc;
+    frame->forceIDR = forceIDR;
+    frame->pts = pts;
+    frame->max_frame_size = engine->next_max_frame_size;
+    engine->next_max_frame_size = 0;
+    frame->u = frame->y + width * height;
+    frame->v = frame->u + u_size;
+    memcpy(frame->y, y, width * height);
+    memcpy(frame->u, u, u_size);
+    if (v_size)
+        memcpy(frame->v, v, v_size);
+    else
+        frame->v = frame->u + 1;
+
+    atomic_fetch_add_explicit(&engine->submitted, 1, memory_order_relaxed);
+    atomic_store_explicit(&engine->frame_head, head + 1, memory_order_release);
+    sem_post(&engine->frame_ready);
+    return 0;
+}
+
+/*
+ * Select what the worker does once more than 'threshold' frames are
+ * waiting for it, instead of letting latency build up without bound.
+ */
+void engineSetOverloadPolicy(void * eng, int policy, int threshold)
+{
+    VA264Engine * engine = (VA264Engine *)eng;
+
+    if (threshold < 1)
+        threshold = 1;
+    atomic_store_explicit(&engine->overload_threshold, threshold, memory_order_relaxed);
+    atomic_store_explicit(&engine->overload_policy, policy, memory_order_relaxed);
+}
+
+/*
+ * setNextFrameMaxSize for the next frame handed to engineSubmit, from the
+ * thread that submits.  A frame dropped by the overload policy takes its
+ * cap with it.
+ */
+void engineSetNextFrameMaxSize(void * eng, unsigned int max_frame_size)
+{
+    VA264Engine * engine = (VA264Engine *)eng;
+
+    engine->next_max_frame_size = max_frame_size;
+}
+
+void engineGetStats(void * eng, VA264EngineStats * stats)
+{
+    VA264Engine * engine = (VA264Engine *)eng;
+
+    stats->submitted = atomic_load_explicit(&engine->submitted, memory_order_relaxed);
+    stats->encoded = atomic_load_explicit(&engine->encoded, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&engine->dropped, memory_order_relaxed);
+    stats->skipped = atomic_load_explicit(&engine->skipped, memory_order_relaxed);
+    stats->rejected = atomic_load_explicit(&engine->rejected, memory_order_relaxed);
+    stats->queue_depth = atomic_load_explicit(&engine->frame_head, memory_order_relaxed) -
+                         atomic_load_explicit(&engine->frame_tail, memory_order_relaxed);
+    stats->max_queue_depth = atomic_load_explicit(&engine->max_queue_depth, memory_order_relaxed);
+}
+
+/*
+ * Return the oldest coded frame, waiting up to timeout_ms for one to become
+ * available (0 polls, a negative timeout waits forever).  The data stays
+ * valid until engineRelease.  A coded frame that failed to encode is
+ * returned with *encodedsize set to -1, a frame still held back for B frame
+ * reordering with 0.  info, if given, receives the coded frame's PTS/DTS.
+ */
+uint8_t * engineReceive(void * eng, int * encodedsize, VA264FrameInfo * info, int timeout_ms)
+{
+    VA264Engine * engine = (VA264Engine *)eng;
+    int ret;
+
+    if (timeout_ms == 0) {
+        ret = sem_trywait(&engine->packet_ready);
+    } else if (timeout_ms < 0) {
+        while ((ret = sem_wait(&engine->packet_ready)) != 0 && errno == EINTR)
+            ;
+    } else {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while ((ret = sem_timedwait(&engine->packet_ready, &ts)) != 0 && errno == EINTR)
+            ;
+    }
+    if (ret != 0)
+        return NULL;
+
+    unsigned int tail = atomic_load_explicit(&engine->packet_tail, memory_order_relaxed);
+    engine_packet * packet = &engine->packets[tail % engine->depth];
+
+    *encodedsize = packet->size;
+    if (info)
+        *info = packet->info;
+    return packet->data;
+}
+
+void engineRelease(void * eng)
+{
+    VA264Engine * engine = (VA264Engine *)eng;
+    unsigned int tail = atomic_load_explicit(&engine->packet_tail, memory_order_relaxed);
+
+    atomic_store_explicit(&engine->packet_tail, tail + 1, memory_order_release);
+    sem_post(&engine->packet_space);
+}
@@ -0,0 +1,146 @@
+/*
+ * Completion poller.
+ *
+ * One thread services every context that asked for an eventfd: it checks
+ * the picture each armed context has in flight with vaQuerySurfaceStatus and
+ * signals the context's eventfd once it is done.  Callers can then wait on
+ * many sessions from a single epoll loop instead of parking one thread per
+ * session in vaSyncSurface.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "va_h264.h"
+
+#define MAX_POLLED_CONTEXTS 256
+
+static pthread_mutex_t g_poller_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_poller_running;
+static unsigned int g_poller_generation;
+static int g_poller_interval_us = 200;
+static VA264Context *g_polled_contexts[MAX_POLLED_CONTEXTS];
+static int g_num_polled_contexts;
+
+static void * completion_poller(void * arg)
+{
+    unsigned int generation = (unsigned int)(uintptr_t)arg;
+    struct timespec interval;
+    uint64_t one = 1;
+    int i;
+
+    pthread_mutex_lock(&g_poller_lock);
+    /* a poller stopped while asleep must not keep running next to its successor */
+    while (g_poller_running && generation == g_poller_generation) {
+        for (i = 0; i < g_num_polled_contexts; i++) {
+            VA264Context * context = g_polled_contexts[i];
+            uint64_t armed = __atomic_load_n(&context->notify_armed, __ATOMIC_ACQUIRE);
+            VASurfaceStatus status;
+
+            if (!armed)
+                continue;
+
+            /*
+             * Only the surface armed by encodeSubmit is looked at, the rest of
+             * the context belongs to its owner.  Done or failed, either way
+             * the owner has to collect it, unless it already has.
+             */
+            if ((vaQuerySurfaceStatus(context->va_dpy, (VASurfaceID)armed, &status) != VA_STATUS_SUCCESS ||
+                 !(status & VASurfaceRendering)) &&
+                __atomic_compare_exchange_n(&context->notify_armed, &armed, 0, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                if (write(context->event_fd, &one, sizeof(one)) != sizeof(one))
+                    fprintf(stderr, "error: failed to signal encode completion\n");
+            }
+        }
+
+        interval.tv_sec = g_poller_interval_us / 1000000;
+        interval.tv_nsec = (g_poller_interval_us % 1000000) * 1000;
+        pthread_mutex_unlock(&g_poller_lock);
+        nanosleep(&interval, NULL);
+        pthread_mutex_lock(&g_poller_lock);
+    }
+    pthread_mutex_unlock(&g_poller_lock);
+
+    return NULL;
+}
+
+int encodeEventFd(void * ctx, int poll_interval_us)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    int fd;
+
+    if (context->event_fd >= 0)
+        return context->event_fd;
+
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&g_poller_lock);
+
+    if (g_num_polled_contexts == MAX_POLLED_CONTEXTS) {
+        pthread_mutex_unlock(&g_poller_lock);
+        close(fd);
+        return -1;
+    }
+
+    /* the shortest interval asked for wins */
+    if (poll_interval_us > 0 && (g_num_polled_contexts == 0 || poll_interval_us < g_poller_interval_us))
+        g_poller_interval_us = poll_interval_us;
+
+    context->event_fd = fd;
+    g_polled_contexts[g_num_polled_contexts++] = context;
+
+    if (!g_poller_running) {
+        pthread_t thread;
+
+        g_poller_running = 1;
+        g_poller_generation++;
+        if (pthread_create(&thread, NULL, completion_poller, (void *)(uintptr_t)g_poller_generation) == 0) {
+            pthread_detach(thread);
+        } else {
+            g_poller_running = 0;
+            g_num_polled_contexts--;
+            context->event_fd = -1;
+            pthread_mutex_unlock(&g_poller_lock);
+            close(fd);
+            return -1;
+        }
+    }
+
+    pthread_mutex_unlock(&g_poller_lock);
+    return fd;
+}
+
+void encodeEventFdClose(void * ctx)
+{
+    VA264Context * context = (VA264Context *)ctx;
+    int i;
+
+    if (context->event_fd < 0)
+        return;
+
+    pthread_mutex_lock(&g_poller_lock);
+
+    for (i = 0; i < g_num_polled_contexts; i++) {
+        if (g_polled_contexts[i] == context) {
+            g_polled_contexts[i] = g_polled_contexts[--g_num_polled_contexts];
+            break;
+        }
+    }
+
+    if (g_num_polled_contexts == 0)
+        g_poller_running = 0;
+
+    pthread_mutex_unlock(&g_poller_lock);
+
+    close(context->event_fd);
+    context->event_fd = -1;
+}
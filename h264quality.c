@@ -0,0 +1,140 @@
+/*
+ * Quality metrics.
+ *
+ * PSNR from the sum of squared differences, and SSIM as in Wang et al.
+ * over 8x8 windows, overlapping by half, without the Gaussian weighting.
+ * The squared error takes 16 pixels and a window row 8 pixels at a time
+ * with SSE2 where the compiler targets it.
+ */
+
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "h264quality.h"
+
+#define SSIM_WINDOW     8
+#define SSIM_GRID       4
+#define SSIM_C1         (0.01 * 255 * 0.01 * 255)
+#define SSIM_C2         (0.03 * 255 * 0.03 * 255)
+
+#if defined(__SSE2__)
+static uint32_t hsum_epi32(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_srli_si128(v, 8));
+    v = _mm_add_epi32(v, _mm_srli_si128(v, 4));
+    return _mm_cvtsi128_si32(v);
+}
+#endif
+
+uint64_t qualitySSE(const uint8_t * a, int a_stride, const uint8_t * b, int b_stride,
+                    int width, int height, int step)
+{
+    uint64_t sse = 0;
+    int x, y, d;
+
+    if (step < 1)
+        step = 1;
+    for (y = 0; y < height; y += step) {
+        const uint8_t * ra = a + y * a_stride;
+        const uint8_t * rb = b + y * b_stride;
+
+        x = 0;
+#if defined(__SSE2__)
+        /* a row of 4096 pixels stays below 2^32 per lane */
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc = zero;
+
+        for (; x + 16 <= width; x += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(ra + x));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(rb + x));
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        }
+        sse += hsum_epi32(acc);
+#endif
+        for (; x < width; x++) {
+            d = ra[x] - rb[x];
+            sse += d * d;
+        }
+    }
+    return sse;
+}
+
+double qualityPSNR(uint64_t sse, uint64_t samples)
+{
+    if (sse == 0 || samples == 0)
+        return 100.0;
+    return 10.0 * log10(255.0 * 255.0 * samples / sse);
+}
+
+/* sums over one window: of a, of b, of a^2 + b^2, and of a * b */
+static void window_sums(const uint8_t * a, int a_stride, const uint8_t * b, int b_stride, uint32_t sums[4])
+{
+    int j;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sa = zero, sb = zero, ss = zero, sab = zero;
+
+    for (j = 0; j < SSIM_WINDOW; j++) {
+        __m128i va = _mm_loadl_epi64((const __m128i *)(a + j * a_stride));
+        __m128i vb = _mm_loadl_epi64((const __m128i *)(b + j * b_stride));
+
+        sa = _mm_add_epi64(sa, _mm_sad_epu8(va, zero));
+        sb = _mm_add_epi64(sb, _mm_sad_epu8(vb, zero));
+        va = _mm_unpacklo_epi8(va, zero);
+        vb = _mm_unpacklo_epi8(vb, zero);
+        ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(va, va), _mm_madd_epi16(vb, vb)));
+        sab = _mm_add_epi32(sab, _mm_madd_epi16(va, vb));
+    }
+    sums[0] = _mm_cvtsi128_si32(sa);
+    sums[1] = _mm_cvtsi128_si32(sb);
+    sums[2] = hsum_epi32(ss);
+    sums[3] = hsum_epi32(sab);
+#else
+    int i;
+
+    sums[0] = sums[1] = sums[2] = sums[3] = 0;
+    for (j = 0; j < SSIM_WINDOW; j++) {
+        for (i = 0; i < SSIM_WINDOW; i++) {
+            uint32_t pa = a[j * a_stride + i], pb = b[j * b_stride + i];
+
+            sums[0] += pa;
+            sums[1] += pb;
+            sums[2] += pa * pa + pb * pb;
+            sums[3] += pa * pb;
+        }
+    }
+#endif
+}
+
+double qualitySSIM(const uint8_t * a, int a_stride, const uint8_t * b, int b_stride,
+                   int width, int height, int step)
+{
+    const double n = SSIM_WINDOW * SSIM_WINDOW;
+    double ssim = 0, mean_a, mean_b, var, cov;
+    uint32_t sums[4];
+    int x, y, windows = 0;
+
+    if (step < 1)
+        step = 1;
+    for (y = 0; y + SSIM_WINDOW <= height; y += SSIM_GRID * step) {
+        for (x = 0; x + SSIM_WINDOW <= width; x += SSIM_GRID * step) {
+            window_sums(a + y * a_stride + x, a_stride, b + y * b_stride + x, b_stride, sums);
+
+            mean_a = sums[0] / n;
+            mean_b = sums[1] / n;
+            var = sums[2] / n - mean_a * mean_a - mean_b * mean_b;    /* of a plus of b */
+            cov = sums[3] / n - mean_a * mean_b;
+            ssim += (2 * mean_a * mean_b + SSIM_C1) * (2 * cov + SSIM_C2) /
+                    ((mean_a * mean_a + mean_b * mean_b + SSIM_C1) * (var + SSIM_C2));
+            windows++;
+        }
+    }
+    return windows ? ssim / windows : 1.0;
+}
@@ -0,0 +1,22 @@
+#ifndef VA264_QUALITY_H
+#define VA264_QUALITY_H
+
+#include <stdint.h>
+
+/*
+ * Objective quality of a reconstructed picture against its source, on
+ * 8-bit planes.  Plain C without libva.  'step' subsamples: every step-th
+ * row for the squared error, every step-th SSIM window in each direction,
+ * 1 for the full picture.
+ */
+
+/* sum of squared differences */
+uint64_t qualitySSE(const uint8_t * a, int a_stride, const uint8_t * b, int b_stride,
+                    int width, int height, int step);
+/* in dB from the SSE over 'samples' values, 100 for identical planes */
+double qualityPSNR(uint64_t sse, uint64_t samples);
+/* mean SSIM of 8x8 windows on a 4 pixel grid */
+double qualitySSIM(const uint8_t * a, int a_stride, const uint8_t * b, int b_stride,
+                   int width, int height, int step);
+
+#endif // VA264_QUALITY_H
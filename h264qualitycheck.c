@@ -0,0 +1,63 @@
+/*
+ * Quality metric check.
+ *
+ * Prints the SSE, PSNR and SSIM of h264quality.c for pseudo-random planes
+ * of awkward sizes (odd, not a multiple of the SIMD width, strides wider
+ * than the plane) at a few steps.  The output depends on the inputs only,
+ * so a build with the SSE2 paths and one without must print the same, see
+ * the quality tests in cmake/CMakeLists.txt.
+ *
+ * Build with -DMAKE_QUALITYCHECK.
+ */
+
+#ifdef MAKE_QUALITYCHECK
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "h264quality.h"
+
+static uint32_t lcg_state = 1;
+
+static uint8_t lcg_next(void)
+{
+    lcg_state = lcg_state * 1103515245 + 12345;
+    return lcg_state >> 16;
+}
+
+int main(void)
+{
+    static const int sizes[][2] = { { 16, 16 }, { 17, 9 }, { 33, 31 }, { 641, 361 }, { 1280, 720 } };
+    static const int steps[] = { 1, 2, 3 };
+    int i, j, k, stride;
+    uint8_t * a, * b;
+
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        int width = sizes[i][0], height = sizes[i][1];
+
+        stride = width + 7;
+        a = malloc(stride * height);
+        b = malloc(stride * height);
+        if (!a || !b)
+            return 1;
+        /* b is a, noisy, so the metrics are neither perfect nor meaningless */
+        for (j = 0; j < stride * height; j++) {
+            a[j] = lcg_next();
+            b[j] = (lcg_next() & 3) ? a[j] : lcg_next();
+        }
+
+        for (k = 0; k < (int)(sizeof(steps) / sizeof(steps[0])); k++) {
+            uint64_t sse = qualitySSE(a, stride, b, stride, width, height, steps[k]);
+            uint64_t samples = (uint64_t)width * ((height + steps[k] - 1) / steps[k]);
+
+            printf("%dx%d step %d: sse %llu psnr %.17g ssim %.17g\n", width, height, steps[k],
+                   (unsigned long long)sse, qualityPSNR(sse, samples),
+                   qualitySSIM(a, stride, b, stride, width, height, steps[k]));
+        }
+        free(a);
+        free(b);
+    }
+    return 0;
+}
+
+#endif // MAKE_QUALITYCHECK
@@ -0,0 +1,155 @@
+/*
+ * Software rate control.
+ *
+ * A leaky bucket fills with the coded size of every frame and drains at the
+ * bitrate (the peak bitrate for VBR) each frame interval.  The QP of the
+ * next frame comes from a per frame type complexity estimate, bits times
+ * quantizer step, scaled to a bit budget that steers the bucket back to
+ * half full.  CBR follows the complexity of the last few frames; VBR uses a
+ * slow average, so hard scenes take more bits and easy ones fewer, and
+ * keeps the long-term average on target with a decaying error term.
+ */
+
+#include <math.h>
+
+#include "h264ratecontrol.h"
+
+#define QP_MAX_STEP     4   /* per frame, against the last frame of the same type */
+
+static int rc_type(int frame_type)
+{
+    return (frame_type > VA264_SWRC_I || frame_type < 0) ? VA264_SWRC_I : frame_type;
+}
+
+/* H.264 quantizer step: 0.625 at QP 0, doubling every 6 */
+static double qp_to_qstep(int qp)
+{
+    return 0.625 * pow(2.0, qp / 6.0);
+}
+
+static int qstep_to_qp(double qstep)
+{
+    return (int)lround(6.0 * log2(qstep / 0.625));
+}
+
+static int clamp_qp(VA264RateControl * rc, int qp)
+{
+    if (qp < rc->min_qp)
+        return rc->min_qp;
+    if (qp > rc->max_qp)
+        return rc->max_qp;
+    return qp;
+}
+
+void rateControlInit(VA264RateControl * rc, int mode, unsigned int bitrate, unsigned int max_bitrate, double frame_rate,
+                     unsigned int buffer_size, unsigned int initial_fullness, int initial_qp, int min_qp, int max_qp)
+{
+    int i;
+
+    rc->mode = mode;
+    rateControlSetRate(rc, bitrate, max_bitrate, frame_rate);
+
+    /* a second of video unless an HRD buffer was configured */
+    rc->buffer_size = buffer_size ? buffer_size : rc->bitrate;
+    /* the HRD fullness is the decoder's, the bucket holds what it hasn't received */
+    rc->fullness = initial_fullness ? rc->buffer_size - initial_fullness : rc->buffer_size / 2;
+    if (rc->fullness < 0)
+        rc->fullness = 0;
+    rc->long_term_error = 0;
+
+    rc->min_qp = min_qp > 0 ? min_qp : 1;
+    rc->max_qp = (max_qp > 0 && max_qp <= 51) ? max_qp : 51;
+    rc->initial_qp = clamp_qp(rc, initial_qp);
+    rc->qp = rc->initial_qp;
+    for (i = 0; i < 3; i++) {
+        rc->complexity[i] = 0;
+        rc->last_qp[i] = rc->initial_qp;
+    }
+}
+
+void rateControlSetRate(VA264RateControl * rc, unsigned int bitrate, unsigned int max_bitrate, double frame_rate)
+{
+    rc->bitrate = bitrate;
+    rc->max_bitrate = (rc->mode == VA264_SWRC_VBR && max_bitrate > bitrate) ? max_bitrate : bitrate;
+    rc->frame_rate = frame_rate > 0 ? frame_rate : 30;
+}
+
+int rateControlFrameQP(VA264RateControl * rc, int frame_type)
+{
+    int type = rc_type(frame_type);
+    double budget = rc->bitrate / rc->frame_rate;
+    double scale, complexity;
+    int qp, last;
+
+    if (rc->complexity[type] == 0) {
+        /* no history for this type yet, place it around the P frames */
+        if (type == VA264_SWRC_I)
+            qp = rc->complexity[VA264_SWRC_P] ? rc->last_qp[VA264_SWRC_P] - 3 : rc->initial_qp;
+        else if (type == VA264_SWRC_B)
+            qp = rc->last_qp[VA264_SWRC_P] + 2;
+        else
+            qp = rc->complexity[VA264_SWRC_I] ? rc->last_qp[VA264_SWRC_I] + 3 : rc->initial_qp;
+        rc->qp = clamp_qp(rc, qp);
+        return rc->qp;
+    }
+
+    /* steer the bucket towards half full */
+    scale = 1.0 + (rc->buffer_size / 2 - rc->fullness) / rc->buffer_size;
+    if (rc->mode == VA264_SWRC_VBR)
+        scale *= 1.0 - rc->long_term_error / rc->bitrate;
+    if (scale < 0.3)
+        scale = 0.3;
+    else if (scale > 1.7)
+        scale = 1.7;
+    budget *= scale;
+
+    /* an intra frame gets as many budgets as it is harder than a P frame */
+    if (type != VA264_SWRC_P && rc->complexity[VA264_SWRC_P]) {
+        double ratio = rc->complexity[type] / rc->complexity[VA264_SWRC_P];
+
+        if (type == VA264_SWRC_I)
+            ratio = ratio < 1 ? 1 : (ratio > 8 ? 8 : ratio);
+        else
+            ratio = ratio < 0.25 ? 0.25 : (ratio > 1 ? 1 : ratio);
+        budget *= ratio;
+    }
+
+    /* never plan a frame that overflows the bucket on its own */
+    if (budget > rc->buffer_size - rc->fullness)
+        budget = rc->buffer_size - rc->fullness;
+    if (budget < 1)
+        budget = 1;
+
+    complexity = rc->complexity[type];
+    qp = qstep_to_qp(complexity / budget);
+
+    last = rc->last_qp[type];
+    if (qp > last + QP_MAX_STEP && rc->fullness < rc->buffer_size * 0.9)
+        qp = last + QP_MAX_STEP;
+    else if (qp < last - QP_MAX_STEP)
+        qp = last - QP_MAX_STEP;
+
+    rc->qp = clamp_qp(rc, qp);
+    return rc->qp;
+}
+
+void rateControlUpdate(VA264RateControl * rc, int frame_type, int qp, int coded_bytes)
+{
+    int type = rc_type(frame_type);
+    double bits = coded_bytes * 8.0;
+    double complexity = bits * qp_to_qstep(qp);
+    double alpha = (rc->mode == VA264_SWRC_VBR) ? 0.1 : 0.5;
+    double window = rc->frame_rate * 10;
+
+    if (rc->complexity[type] == 0)
+        rc->complexity[type] = complexity;
+    else
+        rc->complexity[type] += alpha * (complexity - rc->complexity[type]);
+    rc->last_qp[type] = qp;
+
+    rc->fullness += bits - rc->max_bitrate / rc->frame_rate;
+    if (rc->fullness < 0)
+        rc->fullness = 0;
+
+    rc->long_term_error = rc->long_term_error * (1.0 - 1.0 / window) + bits - rc->bitrate / rc->frame_rate;
+}
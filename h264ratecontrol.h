@@ -0,0 +1,40 @@
+#ifndef VA264_RATECONTROL_H
+#define VA264_RATECONTROL_H
+
+/*
+ * Software rate control for drivers that only do CQP.  Plain C without
+ * libva, so it can also be driven by the offline simulator.
+ */
+
+/* same values as VA_RC_CBR and VA_RC_VBR */
+#define VA264_SWRC_CBR  0x2
+#define VA264_SWRC_VBR  0x4
+
+/* frame types, the VA264_FRAME_* values with IDR folded into I */
+#define VA264_SWRC_P    0
+#define VA264_SWRC_B    1
+#define VA264_SWRC_I    2
+
+typedef struct {
+    int             mode;
+    double          bitrate;            /* average target, bits per second */
+    double          max_bitrate;        /* VBR peak the bucket drains at */
+    double          frame_rate;
+    double          buffer_size;        /* leaky bucket, bits */
+    double          fullness;           /* bits coded but not drained yet */
+    double          long_term_error;    /* VBR: decaying sum of bits over the average */
+    double          complexity[3];      /* coded bits times quantizer step, per frame type */
+    int             last_qp[3];
+    int             initial_qp;
+    int             min_qp;
+    int             max_qp;
+    int             qp;                 /* QP picked for the last frame */
+} VA264RateControl;
+
+void rateControlInit(VA264RateControl * rc, int mode, unsigned int bitrate, unsigned int max_bitrate, double frame_rate,
+                     unsigned int buffer_size, unsigned int initial_fullness, int initial_qp, int min_qp, int max_qp);
+void rateControlSetRate(VA264RateControl * rc, unsigned int bitrate, unsigned int max_bitrate, double frame_rate);
+int rateControlFrameQP(VA264RateControl * rc, int frame_type);
+void rateControlUpdate(VA264RateControl * rc, int frame_type, int qp, int coded_bytes);
+
+#endif // VA264_RATECONTROL_H
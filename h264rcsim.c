@@ -0,0 +1,207 @@
+/*
+ * Offline rate control simulator.
+ *
+ * Replays a per-frame trace through the software rate control and an HRD
+ * model of the decoder buffer, without a GPU.  Each trace line is
+ *
+ *     <type> <qp> <bytes>
+ *
+ * with type one of IDR, I, P or B: a frame as it was recorded, coded at qp
+ * into that many bytes.  Lines starting with '#' are comments.  The test
+ * program in h264encoder.c writes such a trace next to its stream; CQP
+ * recordings are best since every frame shares a QP.  The product of size
+ * and quantizer step is taken as the frame's complexity, and the replay
+ * codes it at the simulated QP into complexity / qstep bits.
+ *
+ * Reports the bitrate deviation from the target, decoder buffer underflows
+ * and overflows, and how steady the QP was.  With -t it exits non-zero when
+ * the deviation exceeds the tolerance or the buffer underflows, for CI.
+ *
+ * Build with -DMAKE_RCSIM, see the rcsim target in cmake/CMakeLists.txt.
+ */
+
+#ifdef MAKE_RCSIM
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <math.h>
+
+#include "h264ratecontrol.h"
+
+typedef struct {
+    int     type;       /* VA264_SWRC_* */
+    double  complexity;
+} trace_frame;
+
+static int parse_type(const char * s)
+{
+    if (!strcmp(s, "IDR") || !strcmp(s, "I"))
+        return VA264_SWRC_I;
+    if (!strcmp(s, "B"))
+        return VA264_SWRC_B;
+    if (!strcmp(s, "P"))
+        return VA264_SWRC_P;
+    return -1;
+}
+
+static trace_frame * load_trace(const char * path, int * num_frames)
+{
+    FILE * f = fopen(path, "r");
+    trace_frame * frames = NULL, * grown;
+    int count = 0, capacity = 0, line_no = 0;
+    char line[256], type[16];
+    int qp, bytes;
+
+    if (!f) {
+        fprintf(stderr, "error: can't open trace %s\n", path);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%15s %d %d", type, &qp, &bytes) != 3 || parse_type(type) < 0) {
+            fprintf(stderr, "error: %s:%d: expected <type> <qp> <bytes>\n", path, line_no);
+            free(frames);
+            fclose(f);
+            return NULL;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            grown = realloc(frames, capacity * sizeof(trace_frame));
+            if (!grown) {
+                free(frames);
+                fclose(f);
+                return NULL;
+            }
+            frames = grown;
+        }
+        frames[count].type = parse_type(type);
+        frames[count].complexity = bytes * 8.0 * 0.625 * pow(2.0, qp / 6.0);
+        count++;
+    }
+
+    fclose(f);
+    *num_frames = count;
+    return frames;
+}
+
+static void usage(const char * name)
+{
+    fprintf(stderr,
+            "usage: %s -i trace [-m cbr|vbr] [-b bitrate] [-p peak] [-f fps]\n"
+            "          [-s hrd_buffer_bits] [-q initial_qp] [-t tolerance_percent] [-v]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    const char * trace = NULL;
+    int mode = VA264_SWRC_CBR;
+    unsigned int bitrate = 1000000, peak = 0, buffer_size = 0;
+    int frame_rate = 30, initial_qp = 26, verbose = 0;
+    double tolerance = -1;
+    trace_frame * frames;
+    VA264RateControl rc;
+    int num_frames, i, c, qp, last_qp = -1, bytes;
+    int underflows = 0, overflows = 0, max_bytes = 0;
+    double total_bits = 0, qp_sum = 0, qp_square_sum = 0, qp_change_sum = 0;
+    double hrd_size, hrd_fullness, actual, deviation, qp_mean, qp_stddev;
+    int failed;
+
+    while ((c = getopt(argc, argv, "i:m:b:p:f:s:q:t:v")) != -1) {
+        switch (c) {
+        case 'i': trace = optarg; break;
+        case 'm': mode = strcmp(optarg, "vbr") ? VA264_SWRC_CBR : VA264_SWRC_VBR; break;
+        case 'b': bitrate = strtoul(optarg, NULL, 0); break;
+        case 'p': peak = strtoul(optarg, NULL, 0); break;
+        case 'f': frame_rate = atoi(optarg); break;
+        case 's': buffer_size = strtoul(optarg, NULL, 0); break;
+        case 'q': initial_qp = atoi(optarg); break;
+        case 't': tolerance = atof(optarg); break;
+        case 'v': verbose = 1; break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (!trace || bitrate == 0 || frame_rate <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    frames = load_trace(trace, &num_frames);
+    if (!frames)
+        return 2;
+    if (num_frames == 0) {
+        fprintf(stderr, "error: empty trace\n");
+        free(frames);
+        return 2;
+    }
+
+    rateControlInit(&rc, mode, bitrate, peak, frame_rate, buffer_size, 0, initial_qp, 0, 51);
+
+    /* the decoder side: filled at the channel rate, emptied a frame at a time, starting half full */
+    hrd_size = rc.buffer_size;
+    hrd_fullness = hrd_size / 2;
+
+    for (i = 0; i < num_frames; i++) {
+        qp = rateControlFrameQP(&rc, frames[i].type);
+        bytes = (int)(frames[i].complexity / (0.625 * pow(2.0, qp / 6.0)) / 8 + 0.5);
+        if (bytes < 1)
+            bytes = 1;
+        rateControlUpdate(&rc, frames[i].type, qp, bytes);
+
+        if (bytes * 8.0 > hrd_fullness) {
+            underflows++;
+            hrd_fullness = 0;
+        } else {
+            hrd_fullness -= bytes * 8.0;
+        }
+        hrd_fullness += rc.max_bitrate / frame_rate;
+        if (hrd_fullness > hrd_size) {
+            /* a CBR channel stuffs, a VBR one stops sending until there's room */
+            if (mode == VA264_SWRC_CBR)
+                overflows++;
+            hrd_fullness = hrd_size;
+        }
+
+        total_bits += bytes * 8.0;
+        qp_sum += qp;
+        qp_square_sum += (double)qp * qp;
+        if (last_qp >= 0)
+            qp_change_sum += abs(qp - last_qp);
+        last_qp = qp;
+        if (bytes > max_bytes)
+            max_bytes = bytes;
+
+        if (verbose)
+            printf("frame %d %s qp %d bytes %d buffer %.0f\n", i,
+                   frames[i].type == VA264_SWRC_I ? "I" : (frames[i].type == VA264_SWRC_B ? "B" : "P"),
+                   qp, bytes, hrd_fullness);
+    }
+
+    actual = total_bits * frame_rate / num_frames;
+    deviation = (actual - bitrate) * 100.0 / bitrate;
+    qp_mean = qp_sum / num_frames;
+    qp_stddev = sqrt(qp_square_sum / num_frames - qp_mean * qp_mean);
+
+    printf("frames:             %d\n", num_frames);
+    printf("target bitrate:     %u\n", bitrate);
+    printf("actual bitrate:     %.0f (%+.2f%%)\n", actual, deviation);
+    printf("largest frame:      %d bytes\n", max_bytes);
+    printf("buffer underflows:  %d\n", underflows);
+    printf("buffer overflows:   %d\n", overflows);
+    printf("QP mean/stddev:     %.2f / %.2f\n", qp_mean, qp_stddev);
+    printf("QP change / frame:  %.2f\n", num_frames > 1 ? qp_change_sum / (num_frames - 1) : 0.0);
+
+    failed = tolerance >= 0 && (fabs(deviation) > tolerance || underflows > 0);
+    if (failed)
+        printf("FAILED\n");
+
+    free(frames);
+    return failed ? 1 : 0;
+}
+
+#endif // MAKE_RCSIM
@@ -0,0 +1,144 @@
+/*
+ * Scene cut detection.
+ *
+ * The luma is reduced to its 8x8 block means, which makes the comparison
+ * cheap and insensitive to noise and small motion.  A cut is a frame whose
+ * block means differ from the previous frame's by several times the usual
+ * amount and whose brightness histogram has changed too, or whose histogram
+ * has changed almost completely.  Camera motion moves the SAD but not the
+ * histogram; a fade moves both gradually, so neither trips the ratio test.
+ * The reduction and the SAD use SSE2 where the compiler targets it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "h264scenecut.h"
+
+#define SAD_MIN         12.0    /* mean block difference a cut needs at least */
+#define SAD_RATIO       3.0     /* against the running mean between cuts */
+#define HIST_MIN        0.2     /* histogram change a cut needs at least */
+#define HIST_CUT        0.6     /* histogram change that is a cut on its own */
+#define MIN_DISTANCE    5       /* frames between cuts, so a flash isn't two */
+
+static void downsample(const uint8_t * src, int stride, uint8_t * dst, int width, int height)
+{
+    int x, y, i, j, sum;
+
+    for (y = 0; y < height; y++) {
+        const uint8_t * row = src + y * VA264_SCENECUT_BLOCK * stride;
+
+        x = 0;
+#if defined(__SSE2__)
+        /* two blocks per 16 bytes, psadbw against zero sums each half */
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 2 <= width; x += 2) {
+            __m128i acc = zero;
+
+            for (j = 0; j < VA264_SCENECUT_BLOCK; j++)
+                acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(row + j * stride + x * VA264_SCENECUT_BLOCK)), zero));
+            dst[y * width + x] = (_mm_cvtsi128_si32(acc) + 32) >> 6;
+            dst[y * width + x + 1] = (_mm_cvtsi128_si32(_mm_srli_si128(acc, 8)) + 32) >> 6;
+        }
+#endif
+        for (; x < width; x++) {
+            sum = 0;
+            for (j = 0; j < VA264_SCENECUT_BLOCK; j++)
+                for (i = 0; i < VA264_SCENECUT_BLOCK; i++)
+                    sum += row[j * stride + x * VA264_SCENECUT_BLOCK + i];
+            dst[y * width + x] = (sum + 32) >> 6;
+        }
+    }
+}
+
+static unsigned int plane_sad(const uint8_t * a, const uint8_t * b, int size)
+{
+    unsigned int sad = 0;
+    int i = 0;
+
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+
+    for (; i + 16 <= size; i += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                              _mm_loadu_si128((const __m128i *)(b + i))));
+    sad = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for (; i < size; i++)
+        sad += abs(a[i] - b[i]);
+    return sad;
+}
+
+int sceneCutInit(VA264SceneCut * sc, int width, int height)
+{
+    memset(sc, 0, sizeof(*sc));
+    sc->width = width / VA264_SCENECUT_BLOCK;
+    sc->height = height / VA264_SCENECUT_BLOCK;
+    if (sc->width < 1 || sc->height < 1)
+        return -1;
+    sc->since_cut = MIN_DISTANCE;
+
+    sc->planes[0] = malloc(sc->width * sc->height);
+    sc->planes[1] = malloc(sc->width * sc->height);
+    if (!sc->planes[0] || !sc->planes[1]) {
+        sceneCutDestroy(sc);
+        return -1;
+    }
+    return 0;
+}
+
+void sceneCutDestroy(VA264SceneCut * sc)
+{
+    free(sc->planes[0]);
+    free(sc->planes[1]);
+    sc->planes[0] = sc->planes[1] = NULL;
+}
+
+/*
+ * Compare the frame with the previous one.  Returns 1 if it starts a new
+ * scene.  The signals stay in sc->sad and sc->hist_diff either way.
+ */
+int sceneCutAnalyze(VA264SceneCut * sc, const uint8_t * luma, int stride)
+{
+    int size = sc->width * sc->height;
+    int cur = sc->current ^ 1;
+    unsigned int * hist = sc->hist[cur];
+    unsigned int * prev_hist = sc->hist[sc->current];
+    unsigned int diff = 0;
+    int i, cut = 0;
+
+    downsample(luma, stride, sc->planes[cur], sc->width, sc->height);
+    memset(hist, 0, sizeof(sc->hist[cur]));
+    for (i = 0; i < size; i++)
+        hist[sc->planes[cur][i] >> 3]++;
+
+    if (sc->frames > 0) {
+        sc->sad = (double)plane_sad(sc->planes[cur], sc->planes[sc->current], size) / size;
+        for (i = 0; i < VA264_SCENECUT_BINS; i++)
+            diff += hist[i] > prev_hist[i] ? hist[i] - prev_hist[i] : prev_hist[i] - hist[i];
+        sc->hist_diff = diff / (2.0 * size);
+
+        if (sc->frames == 1)
+            sc->sad_avg = sc->sad;
+
+        cut = sc->since_cut >= MIN_DISTANCE &&
+              ((sc->sad > SAD_MIN && sc->sad > SAD_RATIO * sc->sad_avg && sc->hist_diff > HIST_MIN) ||
+               sc->hist_diff > HIST_CUT);
+        if (cut)
+            sc->since_cut = 0;
+        else
+            sc->sad_avg += 0.1 * (sc->sad - sc->sad_avg);
+    } else {
+        sc->sad = 0;
+        sc->hist_diff = 0;
+    }
+
+    sc->since_cut++;
+    sc->frames++;
+    sc->current = cur;
+    return cut;
+}
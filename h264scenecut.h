@@ -0,0 +1,34 @@
+#ifndef VA264_SCENECUT_H
+#define VA264_SCENECUT_H
+
+#include <stdint.h>
+
+/*
+ * Scene cut detection on the CPU copy of the luma, compared at 1/8 scale:
+ * the mean absolute difference of 8x8 block means against the previous
+ * frame, and the difference of their 32-bin histograms.
+ */
+
+#define VA264_SCENECUT_BLOCK    8
+#define VA264_SCENECUT_BINS     32
+
+typedef struct {
+    int             width;              /* of the downsampled luma */
+    int             height;
+    uint8_t *       planes[2];          /* current and previous downsampled luma */
+    unsigned int    hist[2][VA264_SCENECUT_BINS];
+    int             current;            /* index of the current plane */
+    int             frames;             /* analyzed so far */
+    int             since_cut;          /* frames since the last cut */
+    double          sad_avg;            /* running mean of sad between cuts */
+
+    /* signals of the last analyzed frame */
+    double          sad;                /* mean absolute difference per downsampled pixel */
+    double          hist_diff;          /* 0 for the same histogram, 1 for disjoint ones */
+} VA264SceneCut;
+
+int sceneCutInit(VA264SceneCut * sc, int width, int height);
+void sceneCutDestroy(VA264SceneCut * sc);
+int sceneCutAnalyze(VA264SceneCut * sc, const uint8_t * luma, int stride);
+
+#endif // VA264_SCENECUT_H
@@ -0,0 +1,304 @@
+/*
+ * Simulcast group.
+ *
+ * Drives one encode context per layer from a single input frame.  The frame
+ * is uploaded once, at full resolution, into the top layer's source surface;
+ * the lower layers are scaled from that surface with video processing on the
+ * same display.  Drivers without VAEntrypointVideoProc fall back to a CPU
+ * box filter, which still saves the caller one color conversion per layer.
+ * All layers are submitted before any of them is waited on, so their encodes
+ * overlap on the GPU.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <va/va_vpp.h>
+
+#include "va_h264.h"
+
+typedef struct {
+    int                 num_layers;
+    int                 scale_down[VA264_MAX_SIMULCAST_LAYERS];
+    VA264Context *      layers[VA264_MAX_SIMULCAST_LAYERS];
+
+    /* GPU scaling */
+    int                 use_vpp;
+    VAConfigID          vpp_config;
+    VAContextID         vpp_context;
+
+    /* CPU scaling fallback, one I420/NV12 frame per lower layer */
+    uint8_t *           scaled[VA264_MAX_SIMULCAST_LAYERS];
+} VA264Simulcast;
+
+typedef struct {
+    uint8_t *   output;
+    int         size;
+} layer_copy;
+
+static int copy_layer_segment(void * userdata, const uint8_t * data, int size)
+{
+    layer_copy * copy = (layer_copy *)userdata;
+
+    memcpy(&copy->output[copy->size], data, size);
+    copy->size += size;
+    return 0;
+}
+
+static int has_video_processing(VADisplay va_dpy)
+{
+    VAEntrypoint *entrypoints;
+    int num_entrypoints, i, found = 0;
+
+    num_entrypoints = vaMaxNumEntrypoints(va_dpy);
+    entrypoints = malloc(num_entrypoints * sizeof(*entrypoints));
+    if (!entrypoints)
+        return 0;
+
+    if (vaQueryConfigEntrypoints(va_dpy, VAProfileNone, entrypoints, &num_entrypoints) == VA_STATUS_SUCCESS) {
+        for (i = 0; i < num_entrypoints; i++) {
+            if (entrypoints[i] == VAEntrypointVideoProc)
+                found = 1;
+        }
+    }
+
+    free(entrypoints);
+    return found;
+}
+
+static int setup_vpp(VA264Simulcast * group)
+{
+    VA264Context * top = group->layers[0];
+    VAStatus va_status;
+
+    if (!has_video_processing(top->va_dpy))
+        return 0;
+
+    va_status = vaCreateConfig(top->va_dpy, VAProfileNone, VAEntrypointVideoProc, NULL, 0, &group->vpp_config);
+    if (va_status != VA_STATUS_SUCCESS)
+        return 0;
+
+    va_status = vaCreateContext(top->va_dpy, group->vpp_config,
+                                top->frame_width_mbaligned, top->frame_height_mbaligned,
+                                VA_PROGRESSIVE, NULL, 0, &group->vpp_context);
+    if (va_status != VA_STATUS_SUCCESS) {
+        vaDestroyConfig(top->va_dpy, group->vpp_config);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Scale the top layer's freshly uploaded source surface into the surface
+ * the layer will encode next.
+ */
+static VAStatus scale_layer_vpp(VA264Simulcast * group, VASurfaceID src, VA264Context * layer)
+{
+    VA264Context * top = group->layers[0];
+    VAProcPipelineParameterBuffer pipeline;
+    VARectangle src_rect, dst_rect;
+    VABufferID pipeline_buf;
+    VAStatus va_status;
+
+    src_rect.x = src_rect.y = 0;
+    src_rect.width = top->config.frame_width;
+    src_rect.height = top->config.frame_height;
+    dst_rect.x = dst_rect.y = 0;
+    dst_rect.width = layer->config.frame_width;
+    dst_rect.height = layer->config.frame_height;
+
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.surface = src;
+    pipeline.surface_region = &src_rect;
+    pipeline.output_region = &dst_rect;
+    pipeline.filter_flags = VA_FILTER_SCALING_FAST;
+
+    va_status = vaBeginPicture(top->va_dpy, group->vpp_context, nextSourceSurface(layer));
+    if (va_status != VA_STATUS_SUCCESS)
+        return va_status;
+
+    va_status = vaCreateBuffer(top->va_dpy, group->vpp_context, VAProcPipelineParameterBufferType,
+                               sizeof(pipeline), 1, &pipeline, &pipeline_buf);
+    if (va_status != VA_STATUS_SUCCESS) {
+        vaEndPicture(top->va_dpy, group->vpp_context);
+        return va_status;
+    }
+
+    va_status = vaRenderPicture(top->va_dpy, group->vpp_context, &pipeline_buf, 1);
+    vaEndPicture(top->va_dpy, group->vpp_context);
+    vaDestroyBuffer(top->va_dpy, pipeline_buf);
+
+    return va_status;
+}
+
+/*
+ * Box filter one plane down by an integer factor.  'step' is 2 for the
+ * interleaved UV plane of NV12, where each component is scaled on its own.
+ */
+static void downscale_plane(const uint8_t * src, int src_stride, uint8_t * dst, int dst_stride,
+                            int dst_width, int dst_height, int factor, int step)
+{
+    int x, y, i, j, c, sum;
+    int area = factor * factor;
+
+    for (y = 0; y < dst_height; y++) {
+        for (x = 0; x < dst_width; x++) {
+            for (c = 0; c < step; c++) {
+                sum = 0;
+                for (j = 0; j < factor; j++) {
+                    const uint8_t * row = src + (y * factor + j) * src_stride;
+                    for (i = 0; i < factor; i++)
+                        sum += row[(x * factor + i) * step + c];
+                }
+                dst[y * dst_stride + x * step + c] = (sum + area / 2) / area;
+            }
+        }
+    }
+}
+
+static void scale_layer_cpu(VA264Simulcast * group, int index, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v,
+                            uint8_t ** ly, uint8_t ** lu, uint8_t ** lv)
+{
+    VA264Context * top = group->layers[0];
+    VA264Context * layer = group->layers[index];
+    int factor = group->scale_down[index];
+    int width = top->config.frame_width;
+    int lw = layer->config.frame_width;
+    int lh = layer->config.frame_height;
+
+    *ly = group->scaled[index];
+    *lu = *ly + lw * lh;
+    downscale_plane(y, width, *ly, lw, lw, lh, factor, 1);
+
+    if (fourcc == VA_FOURCC_NV12) {
+        downscale_plane(u, width, *lu, lw, lw / 2, lh / 2, factor, 2);
+        *lv = *lu + 1;
+    } else {
+        *lv = *lu + (lw / 2) * (lh / 2);
+        downscale_plane(u, width / 2, *lu, lw / 2, lw / 2, lh / 2, factor, 1);
+        downscale_plane(v, width / 2, *lv, lw / 2, lw / 2, lh / 2, factor, 1);
+    }
+}
+
+void destroySimulcastGroup(void * grp)
+{
+    VA264Simulcast * group = (VA264Simulcast *)grp;
+    int i;
+
+    if (group->use_vpp) {
+        vaDestroyContext(group->layers[0]->va_dpy, group->vpp_context);
+        vaDestroyConfig(group->layers[0]->va_dpy, group->vpp_config);
+    }
+
+    /* lower layers first, they hold references on the top layer's display */
+    for (i = group->num_layers - 1; i >= 0; i--) {
+        if (group->layers[i])
+            destroyContext(group->layers[i]);
+        free(group->scaled[i]);
+    }
+    free(group);
+}
+
+/* lower layers are pinned to the top layer's device so VPP can read its surfaces */
+void * createSimulcastGroup(int width, int height, int num_layers, const int * scale_down, const int * bitrates,
+                            int intra_period, int idr_period, int frame_rate, int profile, int rc_mode)
+{
+    VA264Simulcast * group;
+    int i;
+
+    if (num_layers < 1 || num_layers > VA264_MAX_SIMULCAST_LAYERS)
+        return NULL;
+
+    group = (VA264Simulcast *)calloc(1, sizeof(VA264Simulcast));
+    if (!group)
+        return NULL;
+    group->num_layers = num_layers;
+
+    for (i = 0; i < num_layers; i++) {
+        int factor = (i == 0) ? 1 : scale_down[i];
+        int lw = (width / factor) & ~1;
+        int lh = (height / factor) & ~1;
+
+        if (factor < 1 || lw < 16 || lh < 16) {
+            fprintf(stderr, "error: invalid scale for simulcast layer %d\n", i);
+            destroySimulcastGroup(group);
+            return NULL;
+        }
+        group->scale_down[i] = factor;
+
+        if (i == 0) {
+            group->layers[i] = (VA264Context *)createContext(lw, lh, bitrates[i], intra_period, idr_period, 1,
+                                                             frame_rate, profile, rc_mode);
+        } else {
+            group->layers[i] = (VA264Context *)createContextOnDevice(VA264_PLACEMENT_PINNED, group->layers[0]->device,
+                                                                     lw, lh, bitrates[i], intra_period, idr_period, 1,
+                                                                     frame_rate, profile, rc_mode);
+        }
+        if (!group->layers[i]) {
+            destroySimulcastGroup(group);
+            return NULL;
+        }
+    }
+
+    group->use_vpp = setup_vpp(group);
+    if (!group->use_vpp) {
+        printf("No video processing entrypoint, scaling simulcast layers on the CPU\n");
+        for (i = 1; i < num_layers; i++) {
+            group->scaled[i] = malloc(group->layers[i]->config.frame_width * group->layers[i]->config.frame_height * 3 / 2);
+            if (!group->scaled[i]) {
+                destroySimulcastGroup(group);
+                return NULL;
+            }
+        }
+    }
+
+    return group;
+}
+
+/*
+ * Encode one frame on every layer.  outputs[i]/sizes[i] receive layer i's
+ * coded frame, valid until the next call; sizes[i] is -1 if the layer failed.
+ * Returns 0 when every layer encoded.
+ */
+int encodeSimulcast(void * grp, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, bool forceIDR,
+                    uint8_t ** outputs, int * sizes)
+{
+    VA264Simulcast * group = (VA264Simulcast *)grp;
+    VA264Context * top = group->layers[0];
+    int submitted[VA264_MAX_SIMULCAST_LAYERS];
+    int i, ret = 0;
+
+    /* the only upload of the frame */
+    VASurfaceID full = nextSourceSurface(top);
+    submitted[0] = (encodeSubmit(top, fourcc, y, u, v, top->current_frame_input, forceIDR) == 0);
+
+    for (i = 1; i < group->num_layers; i++) {
+        VA264Context * layer = group->layers[i];
+
+        if (group->use_vpp) {
+            submitted[i] = submitted[0] &&
+                           scale_layer_vpp(group, full, layer) == VA_STATUS_SUCCESS &&
+                           encodeSubmit(layer, fourcc, NULL, NULL, NULL, layer->current_frame_input, forceIDR) == 0;
+        } else {
+            uint8_t *ly, *lu, *lv;
+
+            scale_layer_cpu(group, i, fourcc, y, u, v, &ly, &lu, &lv);
+            submitted[i] = (encodeSubmit(layer, fourcc, ly, lu, lv, layer->current_frame_input, forceIDR) == 0);
+        }
+    }
+
+    for (i = 0; i < group->num_layers; i++) {
+        layer_copy copy = { group->layers[i]->encoded_buffer, 0 };
+
+        outputs[i] = copy.output;
+        sizes[i] = -1;
+        if (submitted[i] &&
+            encodeCollect(group->layers[i], VA264_OUTPUT_SEGMENTS, copy_layer_segment, &copy) >= 0)
+            sizes[i] = copy.size;
+        else
+            ret = -1;
+    }
+
+    return ret;
+}
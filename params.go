@@ -1,6 +1,8 @@
 package vaapi_h264
 
 import (
+	"time"
+
 	"github.com/pion/mediadevices/pkg/codec"
 	"github.com/pion/mediadevices/pkg/io/video"
 	"github.com/pion/mediadevices/pkg/prop"
@@ -12,6 +14,78 @@ type Params struct {
 
 	H264Profile		H264Profile
 	RateControlMode	RateControlMode
+
+	// QueueDepth enables the threaded encode engine when greater than zero.
+	// Frames are handed to a dedicated encoder thread through a ring of
+	// QueueDepth slots instead of being encoded inside Read.
+	QueueDepth		int
+
+	// OverloadPolicy applies once more than OverloadThreshold frames are
+	// waiting for the encode engine, QueueDepth-1 by default.  The
+	// threshold must be below QueueDepth, so a policy needs QueueDepth 2
+	// or more.
+	OverloadPolicy		OverloadPolicy
+	OverloadThreshold	int
+
+	// Placement chooses the GPU for the encoder among /dev/dri/renderD*.
+	// Setting Device pins the encoder to that render node.
+	Placement		DevicePlacement
+	Device			string
+
+	// HRDBufferSize sets the VBV buffer in bits, bounding keyframe size.
+	// HRDInitialFullness defaults to half the buffer.  With HRDInVUI the
+	// stream also signals the HRD for players that need it.
+	HRDBufferSize		int
+	HRDInitialFullness	int
+	HRDInVUI		bool
+
+	// MaxFrameSize caps every encoded frame at that many bytes, re-encoding
+	// up to MaxFramePasses times where the driver supports it.
+	MaxFrameSize		int
+	MaxFramePasses		int
+
+	// SceneCutDetection starts a new GOP with an IDR at every scene cut.
+	SceneCutDetection	bool
+
+	// AdaptiveGOP lets scene cuts, motion and static content shape the GOP,
+	// with IDR frames at most MaxGOP frames apart (0 for ten seconds).
+	// Turns on SceneCutDetection.
+	AdaptiveGOP		bool
+	MaxGOP			int
+
+	// IntraRefresh replaces periodic keyframes with a stripe of intra
+	// macroblocks sweeping the picture every IntraRefreshPeriod frames
+	// (0 for a second): 1 for columns, 2 for rows.  Needs driver support.
+	IntraRefresh		int
+	IntraRefreshPeriod	int
+
+	// LongTermReferences keeps that many long-term references (up to 2),
+	// a new one every LongTermInterval frames, so ReportFrameLoss can
+	// recover with a P frame instead of a keyframe.
+	LongTermReferences	int
+	LongTermInterval	int
+
+	// TemporalLayers codes 2 (L1T2) or 3 (L1T3) temporal layers, where each
+	// layer decodes without the ones above it.  TemporalLayer tells which
+	// layer a frame returned by Read belongs to.  Not combined with
+	// IntraRefresh or LongTermReferences.
+	TemporalLayers		int
+
+	// KeyFrameRequestWindow drops ForceKeyFrame requests made that soon
+	// after a keyframe, which the receiver most likely hadn't seen yet.
+	// MinKeyFrameInterval holds further requested keyframes back until that
+	// long after the previous one.  With KeyFrameRecoveryPoint a request
+	// gives an I frame with a recovery point instead of an IDR.
+	KeyFrameRequestWindow	time.Duration
+	MinKeyFrameInterval	time.Duration
+	KeyFrameRecoveryPoint	bool
+
+	// QualityMetrics measures PSNR and SSIM of every frame against its
+	// source, see FrameQuality, on every QualitySubsample-th row and SSIM
+	// window (0 or 1 for all).  Reading the frames back from the GPU costs
+	// time, so this is meant for tuning rather than production.
+	QualityMetrics		bool
+	QualitySubsample	int
 }
 
 type VAAPI_FOURCC uint
@@ -29,6 +29,8 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include "va_h264.h"
 #include "va_display.h"
 
@@ -82,6 +84,340 @@ VADisplay va_open_display(void)
     return va_dpy;
 }
 
+#ifdef HAVE_VA_DRM
+extern VADisplay va_open_display_drm_device(const char *path);
+extern void va_close_display_drm_device(VADisplay va_dpy);
+extern int va_enumerate_drm_devices(char devices[][VA264_DEVICE_PATH_MAX], int max_devices);
+#endif
+
+#define MAX_SHARED_DISPLAYS 16
+#define DISPLAY_LOAD_WINDOW 1.0 /* seconds */
+
+/*
+ * Process wide displays shared by every encode context, one per device.
+ * The first session on a device opens and initializes the driver, the last
+ * one terminates it.  An empty path stands for the display picked by the
+ * display hooks when no render node can be enumerated.
+ */
+typedef struct {
+    char        path[VA264_DEVICE_PATH_MAX];
+    VADisplay   va_dpy;     /* read without the lock by va_report_display_busy */
+    int         sessions;
+    uint64_t    busy_ns;    /* encode time reported so far, updated atomically */
+    uint64_t    busy_seen;  /* busy_ns already folded into busy */
+    double      busy;       /* encode time in seconds, decayed over DISPLAY_LOAD_WINDOW */
+    double      busy_stamp;
+} shared_display;
+
+static pthread_mutex_t g_shared_display_lock = PTHREAD_MUTEX_INITIALIZER;
+static shared_display g_shared_displays[MAX_SHARED_DISPLAYS];
+
+static double
+display_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fraction of the recent window the device spent encoding */
+static double
+display_load(shared_display *display, double now)
+{
+    double elapsed = now - display->busy_stamp;
+    uint64_t busy_ns = __atomic_load_n(&display->busy_ns, __ATOMIC_RELAXED);
+
+    if (display->sessions == 0)
+        return 0;
+
+    display->busy *= DISPLAY_LOAD_WINDOW / (DISPLAY_LOAD_WINDOW + elapsed);
+    display->busy += (busy_ns - display->busy_seen) / 1e9;
+    display->busy_seen = busy_ns;
+    display->busy_stamp = now;
+    return display->busy / DISPLAY_LOAD_WINDOW;
+}
+
+static shared_display *
+find_shared_display(const char *path)
+{
+    int i;
+
+    for (i = 0; i < MAX_SHARED_DISPLAYS; i++) {
+        if (g_shared_displays[i].path[0] || g_shared_displays[i].va_dpy) {
+            if (strcmp(g_shared_displays[i].path, path) == 0)
+                return &g_shared_displays[i];
+        }
+    }
+
+    for (i = 0; i < MAX_SHARED_DISPLAYS; i++) {
+        if (!g_shared_displays[i].path[0] && !g_shared_displays[i].va_dpy) {
+            memset(&g_shared_displays[i], 0, sizeof(g_shared_displays[i]));
+            snprintf(g_shared_displays[i].path, VA264_DEVICE_PATH_MAX, "%s", path);
+            return &g_shared_displays[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+close_shared_display(shared_display *display, VADisplay va_dpy)
+{
+#ifdef HAVE_VA_DRM
+    if (display->path[0])
+        va_close_display_drm_device(va_dpy);
+    else
+#endif
+        va_close_display(va_dpy);
+}
+
+/* whether the driver can encode H.264 at all, in any of the profiles we use */
+static int
+display_can_encode(VADisplay va_dpy)
+{
+    static const VAProfile profiles[] = {
+        VAProfileH264ConstrainedBaseline, VAProfileH264Main, VAProfileH264High
+    };
+    VAEntrypoint *entrypoints;
+    int num_entrypoints, i, j, found = 0;
+
+    num_entrypoints = vaMaxNumEntrypoints(va_dpy);
+    entrypoints = malloc(num_entrypoints * sizeof(*entrypoints));
+    if (!entrypoints)
+        return 0;
+
+    for (i = 0; !found && i < (int)(sizeof(profiles) / sizeof(profiles[0])); i++) {
+        if (vaQueryConfigEntrypoints(va_dpy, profiles[i], entrypoints, &num_entrypoints) != VA_STATUS_SUCCESS)
+            continue;
+        for (j = 0; j < num_entrypoints; j++) {
+            if (entrypoints[j] == VAEntrypointEncSlice || entrypoints[j] == VAEntrypointEncSliceLP)
+                found = 1;
+        }
+        num_entrypoints = vaMaxNumEntrypoints(va_dpy);
+    }
+
+    free(entrypoints);
+    return found;
+}
+
+/*
+ * Open and initialize the driver for the first session on a display.  A
+ * device that fails is given back, so the next placement can skip it.
+ */
+static int
+open_shared_display(shared_display *display)
+{
+    VADisplay va_dpy;
+    int major_ver, minor_ver;
+    VAStatus va_status;
+
+#ifdef HAVE_VA_DRM
+    if (display->path[0])
+        va_dpy = va_open_display_drm_device(display->path);
+    else
+#endif
+        va_dpy = va_open_display();
+
+    if (!va_dpy) {
+        fprintf(stderr, "error: failed to open display '%s'\n", display->path);
+        display->path[0] = 0;
+        return -1;
+    }
+
+    va_status = vaInitialize(va_dpy, &major_ver, &minor_ver);
+    if (va_status != VA_STATUS_SUCCESS) {
+        fprintf(stderr, "error: vaInitialize failed on '%s' (%d)\n", display->path, va_status);
+        close_shared_display(display, va_dpy);
+        display->path[0] = 0;
+        return -1;
+    }
+
+    if (!display_can_encode(va_dpy)) {
+        fprintf(stderr, "error: no H.264 encode entrypoint on '%s'\n", display->path);
+        vaTerminate(va_dpy);
+        close_shared_display(display, va_dpy);
+        display->path[0] = 0;
+        return -1;
+    }
+
+    display->busy = 0;
+    display->busy_stamp = display_clock();
+    __atomic_store_n(&display->va_dpy, va_dpy, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Pick one of the enumerated render nodes according to the placement
+ * policy, trying the next best one whenever a node can't be opened.
+ */
+static shared_display *
+place_shared_display(int placement)
+{
+#ifdef HAVE_VA_DRM
+    char devices[MAX_SHARED_DISPLAYS][VA264_DEVICE_PATH_MAX];
+    double loads[MAX_SHARED_DISPLAYS], now = display_clock();
+    int sessions[MAX_SHARED_DISPLAYS], tried[MAX_SHARED_DISPLAYS] = { 0 };
+    shared_display *display;
+    int num_devices, best, i;
+
+    num_devices = va_enumerate_drm_devices(devices, MAX_SHARED_DISPLAYS);
+    for (i = 0; i < num_devices; i++) {
+        display = find_shared_display(devices[i]);
+        if (!display) {
+            num_devices = i;
+            break;
+        }
+        loads[i] = display_load(display, now);
+        sessions[i] = display->sessions;
+        /* a slot only holds an unopened path while we are placing */
+        if (!display->va_dpy)
+            display->path[0] = 0;
+    }
+
+    while (1) {
+        best = -1;
+        for (i = 0; i < num_devices; i++) {
+            if (tried[i])
+                continue;
+            if (best < 0 ||
+                (placement == VA264_PLACEMENT_LEAST_LOAD && loads[i] < loads[best]) ||
+                (placement == VA264_PLACEMENT_LEAST_LOAD && loads[i] == loads[best] && sessions[i] < sessions[best]) ||
+                (placement != VA264_PLACEMENT_LEAST_LOAD && sessions[i] < sessions[best]))
+                best = i;
+        }
+        if (best < 0)
+            break;
+
+        tried[best] = 1;
+        display = find_shared_display(devices[best]);
+        if (!display)
+            return NULL;
+        if (display->sessions > 0 || open_shared_display(display) == 0)
+            return display;
+    }
+
+    if (num_devices > 0)
+        return NULL;
+#endif
+    display = find_shared_display("");
+    if (display && display->sessions == 0 && open_shared_display(display) != 0)
+        return NULL;
+    return display;
+}
+
+VADisplay
+va_acquire_display(int placement, const char *device)
+{
+    extern const char *g_drm_device_name;
+    shared_display *display;
+
+    pthread_mutex_lock(&g_shared_display_lock);
+
+    if (placement == VA264_PLACEMENT_PINNED && device && device[0])
+        display = find_shared_display(device);
+    else if (g_drm_device_name)
+        display = find_shared_display(g_drm_device_name);
+    else
+        display = place_shared_display(placement);
+
+    if (display && display->sessions == 0 && !display->va_dpy && open_shared_display(display) != 0)
+        display = NULL;
+
+    if (!display) {
+        fprintf(stderr, "error: no usable VA display\n");
+        pthread_mutex_unlock(&g_shared_display_lock);
+        return NULL;
+    }
+
+    display->sessions++;
+
+    pthread_mutex_unlock(&g_shared_display_lock);
+    return display->va_dpy;
+}
+
+void
+va_release_display(VADisplay va_dpy)
+{
+    int i;
+
+    if (!va_dpy)
+        return;
+
+    pthread_mutex_lock(&g_shared_display_lock);
+
+    for (i = 0; i < MAX_SHARED_DISPLAYS; i++) {
+        shared_display *display = &g_shared_displays[i];
+
+        if (display->va_dpy != va_dpy)
+            continue;
+
+        if (--display->sessions == 0) {
+            vaTerminate(display->va_dpy);
+            close_shared_display(display, display->va_dpy);
+            __atomic_store_n(&display->va_dpy, NULL, __ATOMIC_RELEASE);
+            display->path[0] = 0;
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&g_shared_display_lock);
+}
+
+/*
+ * Copy the device path behind va_dpy, empty for the default display.
+ */
+void
+va_display_device_path(VADisplay va_dpy, char *path, int size)
+{
+    int i;
+
+    path[0] = 0;
+    pthread_mutex_lock(&g_shared_display_lock);
+
+    for (i = 0; i < MAX_SHARED_DISPLAYS; i++) {
+        if (g_shared_displays[i].va_dpy == va_dpy) {
+            snprintf(path, size, "%s", g_shared_displays[i].path);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&g_shared_display_lock);
+}
+
+/*
+ * Account encode time against the device behind va_dpy, used by the
+ * VA264_PLACEMENT_LEAST_LOAD policy.  Called for every frame, so it only
+ * adds to the display's counter and leaves the decay to the placement.
+ * The caller holds a session, which keeps its slot from being reused.
+ */
+void
+va_report_display_busy(VADisplay va_dpy, double seconds)
+{
+    int i;
+
+    if (seconds <= 0)
+        return;
+
+    for (i = 0; i < MAX_SHARED_DISPLAYS; i++) {
+        shared_display *display = &g_shared_displays[i];
+
+        if (__atomic_load_n(&display->va_dpy, __ATOMIC_ACQUIRE) == va_dpy) {
+            __atomic_fetch_add(&display->busy_ns, (uint64_t)(seconds * 1e9), __ATOMIC_RELAXED);
+            break;
+        }
+    }
+}
+
+int
+enumerateDevices(char devices[][VA264_DEVICE_PATH_MAX], int max_devices)
+{
+#ifdef HAVE_VA_DRM
+    return va_enumerate_drm_devices(devices, max_devices);
+#else
+    return 0;
+#endif
+}
+
 void
 va_close_display(VADisplay va_dpy)
 {
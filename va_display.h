@@ -47,6 +47,18 @@ va_open_display(void);
 void
 va_close_display(VADisplay va_dpy);
 
+VADisplay
+va_acquire_display(int placement, const char *device);
+
+void
+va_release_display(VADisplay va_dpy);
+
+void
+va_report_display_busy(VADisplay va_dpy, double seconds);
+
+void
+va_display_device_path(VADisplay va_dpy, char *path, int size);
+
 VAStatus
 va_put_surface(
     VADisplay          va_dpy,
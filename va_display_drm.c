@@ -33,9 +33,94 @@
 #endif
 #include "va_display.h"
 
-static int drm_fd = -1;
+#include <string.h>
+#include <dirent.h>
+
+#define MAX_DRM_DISPLAYS 16
+
+/* one DRM fd per open display, so several GPUs can be open at once */
+static struct {
+    VADisplay   va_dpy;
+    int         fd;
+} drm_displays[MAX_DRM_DISPLAYS];
+
 extern const char *g_drm_device_name;
 
+VADisplay
+va_open_display_drm_device(const char *path)
+{
+    VADisplay va_dpy;
+    int i, fd;
+
+    for (i = 0; i < MAX_DRM_DISPLAYS; i++) {
+        if (!drm_displays[i].va_dpy)
+            break;
+    }
+    if (i == MAX_DRM_DISPLAYS)
+        return NULL;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+        return NULL;
+
+    va_dpy = vaGetDisplayDRM(fd);
+    if (!va_dpy) {
+        close(fd);
+        return NULL;
+    }
+
+    drm_displays[i].va_dpy = va_dpy;
+    drm_displays[i].fd = fd;
+    return va_dpy;
+}
+
+void
+va_close_display_drm_device(VADisplay va_dpy)
+{
+    int i;
+
+    for (i = 0; i < MAX_DRM_DISPLAYS; i++) {
+        if (drm_displays[i].va_dpy == va_dpy) {
+            close(drm_displays[i].fd);
+            drm_displays[i].va_dpy = NULL;
+            drm_displays[i].fd = -1;
+            return;
+        }
+    }
+}
+
+static int
+compare_device_paths(const void *a, const void *b)
+{
+    return strcmp((const char *)a, (const char *)b);
+}
+
+/*
+ * List every /dev/dri/renderD* node, sorted so renderD128 comes first.
+ */
+int
+va_enumerate_drm_devices(char devices[][VA264_DEVICE_PATH_MAX], int max_devices)
+{
+    DIR *dir;
+    struct dirent *entry;
+    int num_devices = 0;
+
+    dir = opendir("/dev/dri");
+    if (!dir)
+        return 0;
+
+    while ((entry = readdir(dir)) != NULL && num_devices < max_devices) {
+        if (strncmp(entry->d_name, "renderD", 7) != 0)
+            continue;
+        snprintf(devices[num_devices], VA264_DEVICE_PATH_MAX, "/dev/dri/%s", entry->d_name);
+        num_devices++;
+    }
+    closedir(dir);
+
+    qsort(devices, num_devices, VA264_DEVICE_PATH_MAX, compare_device_paths);
+    return num_devices;
+}
+
 static VADisplay
 va_open_display_drm(void)
 {
@@ -49,33 +134,16 @@ va_open_display_drm(void)
     };
 
     if (g_drm_device_name) {
-        drm_fd = open(g_drm_device_name, O_RDWR);
-        if (drm_fd < 0) {
-            printf("Failed to open the given device!\n");
-            return NULL;
-        }
-
-        va_dpy = vaGetDisplayDRM(drm_fd);
-        if (va_dpy)
-            return va_dpy;
-
-        printf("Failed to a DRM display for the given device\n");
-        close(drm_fd);
-        drm_fd = -1;
-        return NULL;
+        va_dpy = va_open_display_drm_device(g_drm_device_name);
+        if (!va_dpy)
+            printf("Failed to a DRM display for the given device\n");
+        return va_dpy;
     }
 
     for (i = 0; drm_device_paths[i]; i++) {
-        drm_fd = open(drm_device_paths[i], O_RDWR);
-        if (drm_fd < 0)
-            continue;
-
-        va_dpy = vaGetDisplayDRM(drm_fd);
+        va_dpy = va_open_display_drm_device(drm_device_paths[i]);
         if (va_dpy)
             return va_dpy;
-
-        close(drm_fd);
-        drm_fd = -1;
     }
     return NULL;
 }
@@ -83,11 +151,7 @@ va_open_display_drm(void)
 static void
 va_close_display_drm(VADisplay va_dpy)
 {
-    if (drm_fd < 0)
-        return;
-
-    close(drm_fd);
-    drm_fd = -1;
+    va_close_display_drm_device(va_dpy);
 }
 
 
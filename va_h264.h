@@ -5,15 +5,34 @@
 #include <va/va_enc_h264.h>
 #include <stdbool.h>
 
+#include "h264ratecontrol.h"
+#include "h264scenecut.h"
+
 #define SURFACE_NUM 16 /* 16 surfaces for reference */
+#define VA264_DEVICE_PATH_MAX 64
+#define VA264_DEFAULT_FRAME_RATE 30 /* when none is given */
+#define NOTIFY_ARMED (1ULL << 32) /* above any VASurfaceID in notify_armed */
+
+/* how createContextOnDevice picks a DRM render node */
+#define VA264_PLACEMENT_LEAST_SESSIONS  0   /* device with the fewest open contexts */
+#define VA264_PLACEMENT_LEAST_LOAD      1   /* device with the least recent encode time */
+#define VA264_PLACEMENT_PINNED          2   /* the device named by the caller */
 
 typedef struct {
     VAProfile       h264_profile;
     int             h264_entropy_mode;
     int             frame_width;
     int             frame_height;
-    int             frame_rate;
+    int             frame_rate;             /* rounded, for GOP lengths and defaults */
+    int             frame_rate_num;         /* the exact rate, for the stream timing */
+    int             frame_rate_den;
     unsigned int    frame_bitrate;
+    unsigned int    max_bitrate;    /* VBR peak, 0 for the target */
+    unsigned int    hrd_buffer_size;        /* bits, 0 for the driver default */
+    unsigned int    hrd_initial_fullness;   /* bits */
+    int             hrd_in_vui;
+    unsigned int    max_frame_size;         /* bytes, 0 for no cap */
+    int             max_frame_passes;
     int             initial_qp;
     int             minimal_qp;
     int             intra_period;
@@ -22,8 +41,52 @@ typedef struct {
     int             rc_mode;
 } VA264Config;
 
+/* frame types reported in VA264FrameInfo */
+#define VA264_FRAME_P   0
+#define VA264_FRAME_B   1
+#define VA264_FRAME_I   2
+#define VA264_FRAME_IDR 7
+
+/* what was coded, in coding order; pts is the one the frame was submitted with */
+typedef struct {
+    int64_t         pts;
+    int64_t         dts;
+    int             frame_type;
+    bool            keyframe;       /* an IDR, or an I frame coded with a recovery point for a keyframe request */
+    bool            size_overflow;  /* the picture hit the max frame size and was re-encoded, or is still over */
+    int             qp;             /* picked by the software rate control, 0 when the driver picks */
+    unsigned long long frame_id;    /* display order, counting from the first frame */
+    bool            long_term;      /* kept as a long-term reference, see setLongTermReferences */
+    int             temporal_id;    /* temporal layer, 0 for the base, see setTemporalLayers */
+    float           psnr_y;         /* dB against the source, 0 when not measured, see setQualityMetrics */
+    float           psnr;           /* dB over luma and chroma */
+    float           ssim;           /* luma */
+} VA264FrameInfo;
+
+#define VA264_MAX_FRAME_PASSES 4
+
+/* long-term reference slots, and reconstructed surfaces to keep them in */
+#define VA264_MAX_LTR       2
+#define VA264_LTR_SURFACES  (VA264_MAX_LTR + 2)
+#define VA264_MAX_MMCO      4   /* per picture */
+
+#define VA264_MAX_TEMPORAL_LAYERS   3
+
+/* region of interest in pixels, see setNextFrameROI */
+#define VA264_MAX_ROI 16
+
+typedef struct {
+    int             x;
+    int             y;
+    int             width;
+    int             height;
+    int             value;          /* QP delta or priority */
+} VA264ROI;
+
 typedef struct {
     VADisplay                           va_dpy;
+    int                                 placement;
+    char                                device[VA264_DEVICE_PATH_MAX];
 
     VAConfigAttrib                      attrib[VAConfigAttribTypeMax];
     VAConfigAttrib                      config_attrib[VAConfigAttribTypeMax];
@@ -58,13 +121,287 @@ typedef struct {
     unsigned long long                  current_frame_encoding;
     unsigned long long                  current_frame_display;
     unsigned long long                  current_IDR_display;
+    unsigned long long                  poc_display;            /* POC counts from here: the last IDR or recovery picture */
+    int                                 PicOrderCntMsb_ref;
+    int                                 pic_order_cnt_lsb_ref;
+
+    /* input queue: frames arrive in display order and wait for their turn in coding order */
+    unsigned long long                  current_frame_input;    /* display order of the next input frame */
+    unsigned long long                  frames_coded;
+    int                                 frames_pending;         /* inputs not coded yet */
+    int                                 idr_requested;
+    int64_t                             input_pts[SURFACE_NUM];
+    int64_t                             dts_delay;
+    int64_t                             last_dts;
+    unsigned int                        hrd_idr_coded;          /* frames_coded at the last IDR */
+    unsigned int                        hrd_bp_coded;           /* and at the last buffering period SEI */
+    unsigned int                        input_max_frame_size[SURFACE_NUM];
+    unsigned int                        next_max_frame_size;    /* cap for the next input, see setNextFrameMaxSize */
+    unsigned int                        last_max_frame_size;    /* cap sent with the previous picture */
+    int                                 max_frame_size_caps;    /* VAConfigAttribValMaxFrameSize, 0 if unsupported */
+    uint8_t                             max_frame_delta_qp[VA264_MAX_FRAME_PASSES];
+
+    /* regions of interest per input slot, see setNextFrameROI */
+    int                                 roi_caps;               /* VAConfigAttribValEncROI, 0 if unsupported */
+    VAEncROI                            input_roi[SURFACE_NUM][VA264_MAX_ROI];
+    int                                 input_num_roi[SURFACE_NUM];
+    int                                 input_roi_qp_delta[SURFACE_NUM];
+    VAEncROI                            next_roi[VA264_MAX_ROI];
+    int                                 next_num_roi;
+    int                                 next_roi_qp_delta;
+
+    /* rate control in software when the driver only does CQP */
+    int                                 soft_rc_mode;           /* VA_RC_CBR or VA_RC_VBR, 0 when off */
+    VA264RateControl                    soft_rc;
+
+    /* scene cut detection, see setSceneCutDetection */
+    int                                 scene_cut_mode;
+    VA264SceneCut                       scene_cut;
+
+    /* GOP planner: the mini-GOP being coded, in coding order, see plan_mini_gop */
+    unsigned long long                  plan_display[SURFACE_NUM];
+    int                                 plan_type[SURFACE_NUM];
+    int                                 plan_count;
+    int                                 plan_next;
+    unsigned long long                  last_intra_display;
+    int                                 gop_restart;            /* the next frame is an IDR */
+    int                                 gop_static;             /* nothing has moved since the last I frame */
+    int                                 adaptive_gop;
+    int                                 max_gop;
+    int                                 input_cut[SURFACE_NUM];
+    float                               input_sad[SURFACE_NUM]; /* -1 if not analyzed */
+
+    /* long-term references, see setLongTermReferences */
+    int                                 ltr_count;              /* slots, 0 when off */
+    int                                 ltr_interval;           /* frames between new long-term references */
+    int                                 ltr_surfaces;           /* ltr_surface[] exists */
+    VASurfaceID                         ltr_surface[VA264_LTR_SURFACES];
+    VAPictureH264                       ltr_pic[VA264_MAX_LTR]; /* VA_PICTURE_H264_INVALID when the slot is empty */
+    int                                 ltr_pic_surface[VA264_MAX_LTR];
+    unsigned long long                  ltr_display[VA264_MAX_LTR];
+    unsigned long long                  ltr_marked[VA264_MAX_LTR];  /* display order of the picture that marked it */
+    int                                 ltr_max_idx_set;        /* MaxLongTermFrameIdx sent since the IDR */
+    int                                 ltr_candidate;          /* ltr_surface[] of the last reference picture if it is to be marked, -1 */
+    unsigned long long                  ltr_candidate_display;
+    int                                 ltr_mark_surface;       /* the candidate the picture being coded marks */
+    unsigned long long                  ltr_mark_display;
+    int                                 ltr_recover_slot;       /* set by reportFrameLoss, -1 */
+    unsigned long long                  ltr_clean_display;      /* last IDR or recovery picture */
+    long long                           ltr_clean_ref;          /* when its reference was marked, -1 for an IDR */
+    int                                 ltr_recovering;         /* the picture being coded refers only to this slot, -1 */
+    int                                 ltr_mmco[VA264_MAX_MMCO][3];    /* its memory_management_control_operations */
+    int                                 ltr_num_mmco;
+
+    /* rolling intra refresh in place of periodic intra frames, see setIntraRefresh */
+    int                                 intra_refresh_caps;     /* VA_ENC_INTRA_REFRESH_* the driver supports */
+    int                                 intra_refresh_mode;
+    int                                 intra_refresh_period;   /* frames per sweep */
+    int                                 intra_refresh_pos;      /* next column or row of macroblocks */
+    int                                 intra_refresh_start;    /* the picture being coded starts a sweep */
+
+    /* temporal layers, see setTemporalLayers */
+    int                                 temporal_layers;        /* 0 when off */
+    int                                 temporal_pos;           /* position in the layer pattern, 0 at intra pictures */
+    unsigned int                        temporal_base_num;      /* frame_num of the last base layer picture */
+    int                                 temporal_ref;           /* ReferenceFrames[] entry the picture refers to, -1 */
+
+    /* keyframe requests from receivers, see requestKeyFrame */
+    int                                 keyframe_requests;      /* made since the last input, atomic */
+    int                                 keyframe_mode;          /* VA264_KEYFRAME_* */
+    double                              keyframe_window;        /* seconds after a keyframe in which requests are served by it */
+    double                              keyframe_min_interval;  /* seconds between a keyframe and a requested one */
+    double                              keyframe_time;          /* when the last IDR or recovery point I frame was coded */
+    int                                 keyframe_pending;       /* waits for the minimum interval */
+    int                                 intra_requested;        /* the next anchor picture is a recovery point I frame */
+    int                                 keyframe_recovery;      /* the picture being coded is one */
+
+    /* quality of the reconstruction, see setQualityMetrics */
+    int                                 quality_metrics;        /* VA264_QUALITY_* bits, 0 when off */
+    int                                 quality_step;           /* every quality_step-th row and SSIM window */
+
+    /* macroblock QP maps per input slot, see setNextFrameQPMap */
+    int                                 qp_block_size;          /* 0 if the driver takes no QP map */
+    VABufferID                          qp_buf[SURFACE_NUM];
+    int8_t                             *qp_delta[SURFACE_NUM];  /* lowest delta per block, resolved at render time */
+    int                                 input_qp_map[SURFACE_NUM];
+    int                                 next_qp_map;
+    VA264FrameInfo                      frame_info;             /* the picture in flight or last delivered */
+
+    /* rate changes requested by setBitrate/setFrameRate, applied at the next picture */
+    int                                 rc_update;
+    uint64_t                            next_bitrate;       /* target << 32 | peak, set in one store */
+    int                                 fr_update;
+    uint64_t                            next_frame_rate;    /* num << 32 | den */
+
+    /* completion of the picture in flight, see setSyncMode/encodeSubmit */
+    int                                 sync_mode;
+    int                                 poll_interval_us;
+    int                                 picture_pending;
+    double                              submit_time;
+    int                                 event_fd;
+    uint64_t                            notify_armed;       /* NOTIFY_ARMED | surface in flight, 0 when disarmed */
+    int                                 engine_attached;    /* an engine worker owns the context, see createEngine */
 
     uint8_t *                           encoded_buffer;
+    uint8_t *                           batch_buffer;       /* coded frames returned by encodeImages */
+    int                                 batch_buffer_size;
     VA264Config config;
 } VA264Context;
 
+/* output modes for encodeImageSegments */
+#define VA264_OUTPUT_SEGMENTS   0   /* one callback per VACodedBufferSegment */
+#define VA264_OUTPUT_NALS       1   /* one callback per Annex B NAL unit, start code included */
+
+/*
+ * Receives coded data while the coded buffer is still mapped, so 'data' is
+ * only valid for the duration of the call.  Return non-zero to skip the
+ * remainder of the frame.
+ */
+typedef int (*VA264OutputCallback)(void * userdata, const uint8_t * data, int size);
+
 void destroyContext(void * ctx);
 void * createContext(int width, int height, int bitrate, int intra_period, int idr_period, int ip_period, int frame_rate, int profile, int rc_mode);
+void * createContextOnDevice(int placement, const char * device, int width, int height, int bitrate, int intra_period, int idr_period, int ip_period, int frame_rate, int profile, int rc_mode);
+void setBitrate(void * ctx, unsigned int bitrate, unsigned int max_bitrate);
+void setFrameRate(void * ctx, int frame_rate);
+void setFrameRateFraction(void * ctx, int num, int den);
+void setMaxFrameSize(void * ctx, unsigned int max_frame_size, int passes);
+void setNextFrameMaxSize(void * ctx, unsigned int max_frame_size);
+int setNextFrameROI(void * ctx, const VA264ROI * rois, int num_rois, bool qp_delta);
+int setNextFrameQPMap(void * ctx, const int8_t * map, int stride);
+
+/* what a scene cut becomes, see setSceneCutDetection */
+#define VA264_SCENECUT_OFF  0
+#define VA264_SCENECUT_IDR  1
+#define VA264_SCENECUT_I    2
+
+int setSceneCutDetection(void * ctx, int mode);
+int setAdaptiveGOP(void * ctx, bool enable, int max_gop);
+
+/* intra refresh patterns, see setIntraRefresh */
+#define VA264_REFRESH_OFF       0
+#define VA264_REFRESH_COLUMN    1   /* a column of macroblocks sweeping left to right */
+#define VA264_REFRESH_ROW       2   /* a row of macroblocks sweeping top to bottom */
+
+int setIntraRefresh(void * ctx, int mode, int period);
+
+/* what reportFrameLoss did about a loss */
+#define VA264_RECOVER_NONE  0   /* the loss predates the last IDR or recovery picture */
+#define VA264_RECOVER_LTR   1   /* the next picture refers only to a long-term reference */
+#define VA264_RECOVER_IDR   2   /* the next picture is an IDR */
+
+int setLongTermReferences(void * ctx, int count, int interval);
+int reportFrameLoss(void * ctx, unsigned long long lost_frame_id, long long ref_frame_id);
+int setTemporalLayers(void * ctx, int layers);
+
+/* what a keyframe request produces, see setKeyFrameRequests */
+#define VA264_KEYFRAME_IDR  0
+#define VA264_KEYFRAME_I    1   /* an I frame with a recovery point SEI, the references before it dropped */
+
+int setKeyFrameRequests(void * ctx, int mode, int window_ms, int min_interval_ms);
+void requestKeyFrame(void * ctx);
+
+/* what setQualityMetrics measures, OR'ed together */
+#define VA264_QUALITY_OFF   0
+#define VA264_QUALITY_PSNR  1
+#define VA264_QUALITY_SSIM  2
+
+void setQualityMetrics(void * ctx, int metrics, int step);
+void setHRD(void * ctx, unsigned int buffer_size, unsigned int initial_fullness, bool in_vui);
+int reconfigureContext(void * ctx, int width, int height, int bitrate, int intra_period, int idr_period, int ip_period, int frame_rate, int profile, int rc_mode);
+int enumerateDevices(char devices[][VA264_DEVICE_PATH_MAX], int max_devices);
 uint8_t * encodeImage(void * ctx, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int * encodedsize, bool forceIDR);
+uint8_t * encodeImageTimed(void * ctx, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int64_t pts,
+                           int * encodedsize, bool forceIDR, VA264FrameInfo * info);
+int encodeImageSegments(void * ctx, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int64_t pts, bool forceIDR,
+                        int output_mode, VA264OutputCallback callback, void * userdata);
+int encodeSkipFrame(void * ctx, int64_t pts, VA264OutputCallback callback, void * userdata);
+int encodeFlush(void * ctx, int output_mode, VA264OutputCallback callback, void * userdata);
+void encodeFrameInfo(void * ctx, VA264FrameInfo * info);
+VASurfaceID nextSourceSurface(void * ctx);
+
+/* batch encode, for offline transcodes where latency doesn't matter */
+typedef struct {
+    int         fourcc;
+    uint8_t *   y;
+    uint8_t *   u;
+    uint8_t *   v;
+    int64_t     pts;
+    bool        forceIDR;
+    unsigned int max_frame_size;    /* bytes, 0 for the setMaxFrameSize cap */
+} VA264Frame;
+
+typedef struct {
+    uint8_t *       data;
+    int             size;
+    VA264FrameInfo  info;
+} VA264CodedFrame;
+
+int encodeImages(void * ctx, const VA264Frame * frames, int num_frames, VA264CodedFrame * outputs);
+
+/* how an encode waits for the GPU, see setSyncMode */
+#define VA264_SYNC_BLOCKING     0   /* vaSyncSurface, polled when given a timeout */
+#define VA264_SYNC_POLL         1   /* vaQuerySurfaceStatus every poll_interval_us */
+#define VA264_SYNC_BUFFER       2   /* vaSyncBuffer with a timeout (libva 2.9+) */
+
+void setSyncMode(void * ctx, int sync_mode, int poll_interval_us);
+int encodeSubmit(void * ctx, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int64_t pts, bool forceIDR);
+int encodeQuery(void * ctx, int timeout_us);
+int encodeCollect(void * ctx, int output_mode, VA264OutputCallback callback, void * userdata);
+
+/*
+ * Returns an eventfd that becomes readable when the frame queued with
+ * encodeSubmit has finished encoding.  One shared poller thread watches
+ * every context that has an eventfd, so a single epoll loop can service
+ * many sessions.  The fd is closed by encodeEventFdClose or destroyContext.
+ */
+int encodeEventFd(void * ctx, int poll_interval_us);
+void encodeEventFdClose(void * ctx);
+
+/*
+ * Threaded engine: a worker thread takes ownership of a context created with
+ * createContext and is fed through lock-free SPSC rings of queue_depth slots.
+ * engineSubmit copies the frame and returns -1 if the input ring is full.
+ * destroyEngine also destroys the context.
+ */
+/* what the engine worker does when more frames than the threshold are queued */
+#define VA264_OVERLOAD_NONE             0   /* encode everything, engineSubmit fails once the ring is full */
+#define VA264_OVERLOAD_DROP_OLDEST      1   /* drop queued frames until the backlog is under the threshold */
+#define VA264_OVERLOAD_SKIP             2   /* emit P-skip frames for the backlog instead of encoding it */
+#define VA264_OVERLOAD_REDUCE_FRAMERATE 3   /* encode every other frame until the queue has drained */
+
+typedef struct {
+    unsigned long long  submitted;      /* frames accepted by engineSubmit */
+    unsigned long long  encoded;        /* frames encoded on the GPU */
+    unsigned long long  dropped;        /* queued frames dropped by the overload policy */
+    unsigned long long  skipped;        /* frames replaced by P-skip frames */
+    unsigned long long  rejected;       /* frames refused by engineSubmit because the ring was full */
+    unsigned int        queue_depth;    /* frames currently waiting for the worker */
+    unsigned int        max_queue_depth;
+} VA264EngineStats;
+
+void * createEngine(void * ctx, int queue_depth);
+void destroyEngine(void * engine);
+int engineSubmit(void * engine, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, int64_t pts, bool forceIDR);
+uint8_t * engineReceive(void * engine, int * encodedsize, VA264FrameInfo * info, int timeout_ms);
+void engineRelease(void * engine);
+void engineSetOverloadPolicy(void * engine, int policy, int threshold);
+void engineGetStats(void * engine, VA264EngineStats * stats);
+void engineSetNextFrameMaxSize(void * engine, unsigned int max_frame_size);
+
+
+/*
+ * Simulcast: one upload feeds num_layers encodes.  Layer 0 runs at
+ * width x height, layer i at the size divided by scale_down[i] (scale_down[0]
+ * is ignored) with bitrates[i].  Lower layers are scaled from the uploaded
+ * surface with video processing, or on the CPU if the driver lacks it.
+ */
+#define VA264_MAX_SIMULCAST_LAYERS 4
+
+void * createSimulcastGroup(int width, int height, int num_layers, const int * scale_down, const int * bitrates,
+                            int intra_period, int idr_period, int frame_rate, int profile, int rc_mode);
+void destroySimulcastGroup(void * group);
+int encodeSimulcast(void * group, int fourcc, uint8_t * y, uint8_t * u, uint8_t * v, bool forceIDR,
+                    uint8_t ** outputs, int * sizes);
 
 #endif // VA_VA264
\ No newline at end of file
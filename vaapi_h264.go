@@ -6,13 +6,16 @@ package vaapi_h264
 
 // #cgo CFLAGS: -DHAVE_VA_DRM=1
 // #cgo pkg-config: libva libva-drm
+// #include <stdlib.h>
 // #include "va_h264.h"
 import "C"
 import (
 	"errors"
 	"image"
 	"io"
+	"math"
 	"sync"
+	"sync/atomic"
 	"unsafe"
 
 	"github.com/pion/mediadevices/pkg/codec"
@@ -21,11 +24,32 @@ import (
 )
 
 type encoder struct {
-	context  unsafe.Pointer
-	r        video.Reader
-	mu       sync.Mutex
-	closed   bool
-	forceIDR bool
+	context unsafe.Pointer
+	engine  unsafe.Pointer
+	r       video.Reader
+	mu      sync.Mutex
+	life    sync.RWMutex // read-held by the control calls, Close frees under it
+	closed  int32        // atomic
+	frames  int64
+	layer   int
+	quality FrameQuality
+	capped  bool // the last frame hit its size cap
+
+	nextMaxSize uint32 // atomic, see SetNextFrameMaxSize
+
+	// threaded engine only, owned by Read
+	readMu  sync.Mutex
+	depth   int
+	pending int    // frames submitted and not yet returned or dropped
+	dropped uint64 // engine drops already taken off pending
+}
+
+// FrameQuality is the quality of a coded frame against its source, all
+// zero unless Params.QualityMetrics is set.
+type FrameQuality struct {
+	PSNRY float64 // dB, luma
+	PSNR  float64 // dB, luma and chroma
+	SSIM  float64 // luma
 }
 
 func newEncoder(r video.Reader, p prop.Media, params Params) (codec.ReadCloser, error) {
@@ -34,13 +58,13 @@ func newEncoder(r video.Reader, p prop.Media, params Params) (codec.ReadCloser,
 	}
 
 	/*
-		Assume frame sequence is: Frame#0,#1,#2,...,#M,...,#X,... (encoding order)
-		1) period between Frame #X and Frame #N = #X - #N
-		2) 0 means infinite for intra_period/intra_idr_period, and 0 is invalid for ip_period
-		3) intra_idr_period % intra_period (intra_period > 0) and intra_period % ip_period must be 0
-		4) intra_period and intra_idr_period take precedence over ip_period
-		5) if ip_period > 1, intra_period and intra_idr_period are not  the strict periods
-			of I/IDR frames, see bellow examples
+		Frame types come from the GOP planner in h264encoder.c:
+		1) 0 means infinite for intra_period/intra_idr_period, and 0 is invalid for ip_period
+		2) intra_idr_period % intra_period (intra_period > 0) and intra_period % ip_period must be 0
+		3) periods count frames in display order, an IDR also counts as an I frame
+		4) intra_period and intra_idr_period take precedence over ip_period: the
+			B frames before a periodic I frame are kept, an IDR is never preceded
+			by B frames, so the mini-GOP before it ends early
 		-------------------------------------------------------------------
 		intra_period intra_idr_period ip_period frame sequence (intra_period/intra_idr_period/ip_period)
 		0            ignored          1          IDRPPPPPPP ...     (No IDR/I any more)
@@ -49,38 +73,237 @@ func newEncoder(r video.Reader, p prop.Media, params Params) (codec.ReadCloser,
 		1            1                ignored    IDR IDR IDR IDR...
 		1            >=2              ignored    IDRII IDRII IDR... (1/3/ignore)
 		>=2          0                1          IDRPPP IPPP I...   (3/0/1)
-		>=2          0              >=2          IDR(PBB)(PBB)(IBB) (6/0/3)
-													(PBB)(IBB)(PBB)(IBB)...
+		>=2          0              >=2          IDR(PBB)(IBB)(PBB)(IBB)... (6/0/3)
 		>=2          >=2              1          IDRPPPPP IPPPPP IPPPPP (6/18/1)
 												IDRPPPPP IPPPPP IPPPPP...
-		>=2          >=2              >=2        {IDR(PBB)(PBB)(IBB)(PBB)(IBB)(PBB)} (6/18/3)
-												{IDR(PBB)(PBB)(IBB)(PBB)(IBB)(PBB)}...
-												{IDR(PBB)(PBB)(IBB)(PBB)}           (6/12/3)
-												{IDR(PBB)(PBB)(IBB)(PBB)}...
-												{IDR(PBB)(PBB)}                     (6/6/3)
-												{IDR(PBB)(PBB)}.
+		>=2          >=2              >=2        {IDR(PBB)(IBB)(PBB)(IBB)(PBB)(PB)} (6/18/3)
+												{IDR(PBB)(IBB)(PBB)(IBB)(PBB)(PB)}...
+												{IDR(PBB)(PB)}                     (6/6/3)
+												{IDR(PBB)(PB)}...
 	*/
 
 	// when intra_period and intra_idr_period are equal, all intra-frames will be emitted as IDR frames
-	context := C.createContext(C.int(p.Width), C.int(p.Height), C.int(params.BitRate), C.int(params.KeyFrameInterval), C.int(params.KeyFrameInterval), C.int(1), C.int(p.FrameRate), C.int(VAProfileH264Main), C.int(RateControlCBR))
+	placement := params.Placement
+	var device *C.char
+	if params.Device != "" {
+		placement = PlacementPinned
+		device = C.CString(params.Device)
+		defer C.free(unsafe.Pointer(device))
+	}
+	context := C.createContextOnDevice(C.int(placement), device, C.int(p.Width), C.int(p.Height), C.int(params.BitRate), C.int(params.KeyFrameInterval), C.int(params.KeyFrameInterval), C.int(1), C.int(math.Round(float64(p.FrameRate))), C.int(VAProfileH264Main), C.int(RateControlCBR))
 	if context == unsafe.Pointer(nil) {
 		return nil, errors.New("failed to create vaapi context")
 	}
+	if num, den := frameRateFraction(p.FrameRate); den > 1 {
+		C.setFrameRateFraction(context, C.int(num), C.int(den))
+	}
+	if params.HRDBufferSize > 0 {
+		C.setHRD(context, C.uint(params.HRDBufferSize), C.uint(params.HRDInitialFullness), C.bool(params.HRDInVUI))
+	}
+	if params.MaxFrameSize > 0 {
+		C.setMaxFrameSize(context, C.uint(params.MaxFrameSize), C.int(params.MaxFramePasses))
+	}
+	// the optional features fail when the driver or the rest of the setup can't have them
+	fail := func(what string) (codec.ReadCloser, error) {
+		C.destroyContext(context)
+		return nil, errors.New(what)
+	}
+	if params.SceneCutDetection {
+		if C.setSceneCutDetection(context, C.VA264_SCENECUT_IDR) != 0 {
+			return fail("failed to enable vaapi scene cut detection")
+		}
+	}
+	if params.AdaptiveGOP {
+		if C.setAdaptiveGOP(context, C.bool(true), C.int(params.MaxGOP)) != 0 {
+			return fail("failed to enable the vaapi adaptive GOP")
+		}
+	}
+	if params.IntraRefresh != 0 {
+		if C.setIntraRefresh(context, C.int(params.IntraRefresh), C.int(params.IntraRefreshPeriod)) != 0 {
+			return fail("vaapi intra refresh is not supported with these parameters")
+		}
+	}
+	if params.LongTermReferences > 0 {
+		if C.setLongTermReferences(context, C.int(params.LongTermReferences), C.int(params.LongTermInterval)) != 0 {
+			return fail("vaapi long-term references are not supported with these parameters")
+		}
+	}
+	if params.TemporalLayers > 1 {
+		if C.setTemporalLayers(context, C.int(params.TemporalLayers)) != 0 {
+			return fail("vaapi temporal layers are not supported with these parameters")
+		}
+	}
+	if params.KeyFrameRequestWindow > 0 || params.MinKeyFrameInterval > 0 || params.KeyFrameRecoveryPoint {
+		mode := C.int(C.VA264_KEYFRAME_IDR)
+		if params.KeyFrameRecoveryPoint {
+			mode = C.VA264_KEYFRAME_I
+		}
+		if C.setKeyFrameRequests(context, mode, C.int(params.KeyFrameRequestWindow.Milliseconds()), C.int(params.MinKeyFrameInterval.Milliseconds())) != 0 {
+			return fail("invalid vaapi keyframe request settings")
+		}
+	}
+	if params.QualityMetrics {
+		C.setQualityMetrics(context, C.VA264_QUALITY_PSNR|C.VA264_QUALITY_SSIM, C.int(params.QualitySubsample))
+	}
 
 	e := &encoder{
-		context:  context,
-		r:        video.ToI420(r),
-		closed:   false,
-		forceIDR: false,
+		context: context,
+		r:       video.ToI420(r),
+		depth:   params.QueueDepth,
+	}
+
+	if params.QueueDepth > 0 {
+		e.engine = C.createEngine(context, C.int(params.QueueDepth))
+		if e.engine == unsafe.Pointer(nil) {
+			C.destroyContext(context)
+			return nil, errors.New("failed to start vaapi encode engine")
+		}
+		if params.OverloadPolicy != OverloadNone {
+			// the worker sees at most QueueDepth frames queued
+			threshold := params.OverloadThreshold
+			if threshold <= 0 {
+				threshold = params.QueueDepth - 1
+			}
+			if threshold < 1 || threshold >= params.QueueDepth {
+				C.destroyEngine(e.engine)
+				return nil, errors.New("OverloadThreshold must be between 1 and QueueDepth-1")
+			}
+			C.engineSetOverloadPolicy(e.engine, C.int(params.OverloadPolicy), C.int(threshold))
+		}
 	}
 	return e, nil
 }
 
+// frameRateFraction turns a capture rate into num/den frames per second,
+// over 1001 for the NTSC rates like 29.97 and over 1000 for other
+// fractional ones.
+func frameRateFraction(rate float32) (int, int) {
+	r := float64(rate)
+	if r <= 0 || r == math.Trunc(r) {
+		return int(r), 1
+	}
+	if ntsc := math.Round(r * 1.001); math.Abs(ntsc*1000/1001-r) < 0.005 {
+		return int(ntsc) * 1000, 1001
+	}
+	return int(math.Round(r * 1000)), 1000
+}
+
+// EngineStats reports the threaded engine counters.
+type EngineStats struct {
+	Submitted     uint64
+	Encoded       uint64
+	Dropped       uint64
+	Skipped       uint64
+	Rejected      uint64
+	QueueDepth    int
+	MaxQueueDepth int
+}
+
+// Stats returns the threaded engine counters, all zero when the engine is
+// not in use.
+func (e *encoder) Stats() EngineStats {
+	e.mu.Lock()
+	defer e.mu.Unlock()
+
+	if e.engine == nil || e.isClosed() {
+		return EngineStats{}
+	}
+
+	var s C.VA264EngineStats
+	C.engineGetStats(e.engine, &s)
+	return EngineStats{
+		Submitted:     uint64(s.submitted),
+		Encoded:       uint64(s.encoded),
+		Dropped:       uint64(s.dropped),
+		Skipped:       uint64(s.skipped),
+		Rejected:      uint64(s.rejected),
+		QueueDepth:    int(s.queue_depth),
+		MaxQueueDepth: int(s.max_queue_depth),
+	}
+}
+
+// readThreaded submits the new frame to the encode engine and returns the
+// oldest coded frame.  Up to QueueDepth frames stay in flight, so the GPU
+// works on frame N while the next frames are being captured: Read only
+// waits for the GPU once that many are outstanding.  While the pipeline
+// fills, Read takes further frames from the source rather than return an
+// empty packet, so the first call reads up to QueueDepth frames.
+func (e *encoder) readThreaded() ([]byte, func(), error) {
+	for {
+		img, _, err := e.r.Read()
+		if err != nil {
+			return nil, func() {}, err
+		}
+
+		encoded, ok, err := e.submitThreaded(img.(*image.YCbCr))
+		if ok || err != nil {
+			return encoded, func() {}, err
+		}
+	}
+}
+
+// submitThreaded hands one frame to the engine and collects the oldest coded
+// frame, waiting for it only once QueueDepth frames are outstanding.  ok is
+// false when nothing is ready yet and the pipeline has room for more.
+func (e *encoder) submitThreaded(yuvImg *image.YCbCr) ([]byte, bool, error) {
+	// the rings have a single producer and a single consumer, Read is both
+	e.readMu.Lock()
+	defer e.readMu.Unlock()
+
+	if e.isClosed() {
+		return nil, false, io.EOF
+	}
+
+	C.engineSetNextFrameMaxSize(e.engine, C.uint(atomic.SwapUint32(&e.nextMaxSize, 0)))
+	// pion's reader carries no timestamps, the frame count stands in as PTS
+	if C.engineSubmit(e.engine, C.int(VA_FOURCC_I420), (*C.uchar)(&yuvImg.Y[0]), (*C.uchar)(&yuvImg.Cb[0]), (*C.uchar)(&yuvImg.Cr[0]), C.int64_t(e.frames), C.bool(false)) == 0 {
+		e.frames++
+		e.pending++
+	}
+
+	var rc C.int
+	var info C.VA264FrameInfo
+	for {
+		wait := C.int(0)
+		if e.pending >= e.depth {
+			wait = 10
+		}
+		s := C.engineReceive(e.engine, &rc, &info, wait)
+		if s != nil {
+			e.pending--
+			if rc < 0 {
+				C.engineRelease(e.engine)
+				return nil, false, errors.New("vaapi encode failed")
+			}
+			encoded := C.GoBytes(unsafe.Pointer(s), rc)
+			C.engineRelease(e.engine)
+
+			e.mu.Lock()
+			e.setFrameInfo(&info)
+			e.mu.Unlock()
+			return encoded, true, nil
+		}
+
+		// frames dropped by the overload policy never produce output
+		var st C.VA264EngineStats
+		C.engineGetStats(e.engine, &st)
+		e.pending -= int(uint64(st.dropped) - e.dropped)
+		e.dropped = uint64(st.dropped)
+		if e.pending < e.depth {
+			return nil, false, nil
+		}
+	}
+}
+
 func (e *encoder) Read() ([]byte, func(), error) {
+	if e.engine != nil {
+		return e.readThreaded()
+	}
+
 	e.mu.Lock()
 	defer e.mu.Unlock()
 
-	if e.closed {
+	if e.isClosed() {
 		return nil, func() {}, io.EOF
 	}
 
@@ -90,33 +313,140 @@ func (e *encoder) Read() ([]byte, func(), error) {
 	}
 	yuvImg := img.(*image.YCbCr)
 
+	C.setNextFrameMaxSize(e.context, C.uint(atomic.SwapUint32(&e.nextMaxSize, 0)))
 	var rc C.int
-	s := C.encodeImage(e.context, C.int(VA_FOURCC_I420), (*C.uchar)(&yuvImg.Y[0]), (*C.uchar)(&yuvImg.Cb[0]), (*C.uchar)(&yuvImg.Cr[0]), &rc, C.bool(e.forceIDR))
-	e.forceIDR = false
+	s := C.encodeImage(e.context, C.int(VA_FOURCC_I420), (*C.uchar)(&yuvImg.Y[0]), (*C.uchar)(&yuvImg.Cb[0]), (*C.uchar)(&yuvImg.Cr[0]), &rc, C.bool(false))
 	encoded := C.GoBytes(unsafe.Pointer(s), rc)
+
+	var info C.VA264FrameInfo
+	C.encodeFrameInfo(e.context, &info)
+	e.setFrameInfo(&info)
 	return encoded, func() {}, err
 }
 
+func (e *encoder) setFrameInfo(info *C.VA264FrameInfo) {
+	e.layer = int(info.temporal_id)
+	e.capped = bool(info.size_overflow)
+	e.quality = FrameQuality{
+		PSNRY: float64(info.psnr_y),
+		PSNR:  float64(info.psnr),
+		SSIM:  float64(info.ssim),
+	}
+}
+
+// TemporalLayer returns the temporal layer of the frame last returned by
+// Read, 0 for the base layer or without Params.TemporalLayers.  An SFU
+// forwarding layers up to n drops the frames above it.
+func (e *encoder) TemporalLayer() int {
+	e.mu.Lock()
+	defer e.mu.Unlock()
+	return e.layer
+}
+
+// FrameSizeOverflow tells whether the frame last returned by Read hit the
+// size cap from Params.MaxFrameSize or SetNextFrameMaxSize, and was
+// re-encoded or is still over it.
+func (e *encoder) FrameSizeOverflow() bool {
+	e.mu.Lock()
+	defer e.mu.Unlock()
+	return e.capped
+}
+
+// SetNextFrameMaxSize caps the next frame Read takes from the source at
+// that many bytes, overriding Params.MaxFrameSize for that frame alone.
+// It is safe to call from any goroutine.
+func (e *encoder) SetNextFrameMaxSize(bytes int) error {
+	if e.isClosed() {
+		return io.EOF
+	}
+	if bytes < 0 {
+		return errors.New("frame size cap must not be negative")
+	}
+	atomic.StoreUint32(&e.nextMaxSize, uint32(bytes))
+	return nil
+}
+
+// FrameQuality returns the quality of the frame last returned by Read.
+func (e *encoder) FrameQuality() FrameQuality {
+	e.mu.Lock()
+	defer e.mu.Unlock()
+	return e.quality
+}
+
+func (e *encoder) isClosed() bool {
+	return atomic.LoadInt32(&e.closed) != 0
+}
+
+// SetBitRate changes the target bitrate from the next frame on, without
+// forcing a keyframe.  It is safe to call while the engine is running.
 func (e *encoder) SetBitRate(b int) error {
-	panic("SetBitRate is not implemented")
+	e.life.RLock()
+	defer e.life.RUnlock()
+
+	if e.isClosed() {
+		return io.EOF
+	}
+	if b <= 0 {
+		return errors.New("bitrate must be positive")
+	}
+	C.setBitrate(e.context, C.uint(b), 0)
+	return nil
 }
 
+// ForceKeyFrame asks for a keyframe, coalesced with other requests as set
+// by Params.KeyFrameRequestWindow and MinKeyFrameInterval.  It is safe to
+// call while the engine is running.
 func (e *encoder) ForceKeyFrame() error {
+	e.life.RLock()
+	defer e.life.RUnlock()
+
+	if e.isClosed() {
+		return io.EOF
+	}
+	C.requestKeyFrame(e.context)
+	return nil
+}
+
+// ReportFrameLoss tells the encoder the receiver lost the frame-th frame
+// returned by Read.  The next frame refers to a long-term reference the
+// receiver still has, or is a keyframe.  With the threaded engine it always
+// requests a keyframe, like ForceKeyFrame.
+func (e *encoder) ReportFrameLoss(frame int64) error {
+	e.life.RLock()
+	defer e.life.RUnlock()
+
+	if e.isClosed() {
+		return io.EOF
+	}
+	if e.engine != nil {
+		C.requestKeyFrame(e.context)
+		return nil
+	}
+
+	// reportFrameLoss belongs to the encoding thread, which is Read's
 	e.mu.Lock()
 	defer e.mu.Unlock()
-	e.forceIDR = true
+	C.reportFrameLoss(e.context, C.ulonglong(frame), C.longlong(-1))
 	return nil
 }
 
 func (e *encoder) Close() error {
+	// the same order as the control calls: life before mu
+	e.readMu.Lock()
+	defer e.readMu.Unlock()
+	e.life.Lock()
+	defer e.life.Unlock()
 	e.mu.Lock()
 	defer e.mu.Unlock()
 
-	if e.closed {
+	if !atomic.CompareAndSwapInt32(&e.closed, 0, 1) {
 		return nil
 	}
 
-	C.destroyContext(e.context)
-	e.closed = true
+	if e.engine != nil {
+		C.destroyEngine(e.engine)
+	} else {
+		C.destroyContext(e.context)
+	}
 	return nil
 }
@@ -25,4 +25,24 @@ const (
 	VAProfileH264ConstrainedBaseline	H264Profile = 13
 	VAProfileH264Main					H264Profile = 6
 	VAProfileH264High					H264Profile = 7
-)
\ No newline at end of file
+)
+
+// DevicePlacement selects the DRM render node a new encoder is placed on.
+type DevicePlacement int
+
+const (
+	PlacementLeastSessions	DevicePlacement = 0
+	PlacementLeastLoad		DevicePlacement = 1
+	PlacementPinned			DevicePlacement = 2
+)
+
+// OverloadPolicy selects what the threaded engine does when the GPU falls
+// behind and frames queue up.
+type OverloadPolicy int
+
+const (
+	OverloadNone			OverloadPolicy = 0
+	OverloadDropOldest		OverloadPolicy = 1
+	OverloadSkip			OverloadPolicy = 2
+	OverloadReduceFrameRate	OverloadPolicy = 3
+)